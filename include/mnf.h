@@ -0,0 +1,120 @@
+/*
+ * libmnf - move-nested-files as a library.
+ *
+ * A handle holds options, given in the command-line syntax of mnf(1) or as
+ * an mnf_options_t; mnf_run() moves the files nested below source
+ * directories into a destination directory, in-process and without exec.
+ * Each handle has its own worker pool (--threads), device limits,
+ * destination tables and verbosity, so different handles run at the same
+ * time; a handle does one run at a time. Errors are returned, except that
+ * running out of memory, or failing to write a --journal or --undo-log once
+ * the run has started, ends the process. Link with -lmnf -pthread.
+ */
+#ifndef MNF_H
+#define MNF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mnf mnf_t;
+
+typedef enum {
+    MNF_MOVED = 0,      /* moved to 'target' */
+    MNF_DEDUPED,        /* identical to 'target'; the source was removed */
+    MNF_SKIPPED,        /* left in place (--mode=skip, or cancelled) */
+    MNF_WOULD_MOVE,     /* dry run */
+    MNF_WOULD_DROP,     /* dry run, duplicate */
+    MNF_FAILED          /* 'err' holds the errno */
+} mnf_result_t;
+
+typedef struct {
+    mnf_result_t result;
+    const char *src;    /* valid during the callback only */
+    const char *target; /* "" if there is none */
+    int64_t size;
+    int err;
+} mnf_event_t;
+
+/* Called once per file from the worker threads, possibly concurrently. */
+typedef void (*mnf_event_cb)(const mnf_event_t *ev, void *user);
+
+typedef struct {
+    unsigned long moved, skipped, failed, deduped, queued;
+    unsigned long long bytes;
+} mnf_stats_t;
+
+/* Per-run settings. */
+typedef struct {
+    const char *src, *dst;
+    int dry_run;
+    const char *const *sources; /* if n_sources > 0: these instead of 'src' */
+    size_t n_sources;
+} mnf_run_t;
+
+typedef enum { MNF_MODE_RENAME = 0, MNF_MODE_SKIP, MNF_MODE_OVERWRITE, MNF_MODE_DEDUP } mnf_mode_t;
+typedef enum { MNF_LAYOUT_FLAT = 0, MNF_LAYOUT_CAS } mnf_layout_t;
+
+/*
+ * Handle options as fields; each one matches the mnf(1) option of that name.
+ * Start from mnf_options_init(). Lists are comma-separated; sizes, times and
+ * depths of -1 mean none, times are Unix seconds.
+ */
+typedef struct {
+    int threads;
+    mnf_mode_t mode;
+    mnf_layout_t layout;
+    const char *shard;
+    int min_depth, max_depth;
+    const char *include, *exclude, *allow_ext, *deny_ext;
+    int64_t min_size, max_size, newer_than, older_than;
+    int dry_run, include_symlinks, prune_empty_dirs, preserve_times, ignore_files;
+    const char *device_limit;
+    int verbose;        /* 0 quiet, 1 info, 2 debug */
+} mnf_options_t;
+
+/*
+ * Creates a handle from options as given to mnf(1), without the program name
+ * and without SOURCE_DIR/DEST_DIR. Options that need a process of their own
+ * (--watch, --serve, --events, --trace, --metrics-*, --progress) are
+ * rejected. The files of --journal, --undo-log, --state and --plan-out belong
+ * to the handle and are written by each of its runs; with --plan-in or --undo
+ * every run executes the plan or log, and the run's directories are ignored.
+ * Returns NULL with a message in 'err' on invalid options.
+ */
+mnf_t *mnf_open(int argc, const char *const argv[], char *err, size_t errlen);
+
+/* Sets the defaults of mnf(1), except that verbose is 0. */
+void mnf_options_init(mnf_options_t *opt);
+
+/* Like mnf_open(), from an mnf_options_t. */
+mnf_t *mnf_open_options(const mnf_options_t *opt, char *err, size_t errlen);
+
+/* Sets the per-file callback (NULL to remove it). */
+void mnf_set_callback(mnf_t *m, mnf_event_cb cb, void *user);
+
+/*
+ * Runs one move and waits for it. Returns 0, or -1 with a message in 'err' if
+ * a directory or one of the handle's files is unusable. 'stats' (may be NULL) receives this run's counts;
+ * stats->failed tells whether files could not be moved.
+ */
+int mnf_run(mnf_t *m, const mnf_run_t *run, mnf_stats_t *stats, char *err, size_t errlen);
+
+/*
+ * Asks a running mnf_run() of this handle to stop: no more files are queued
+ * and queued files are reported as skipped. Issued before mnf_run() starts,
+ * it stops the next run. Safe from any thread and from a signal handler.
+ */
+void mnf_cancel(mnf_t *m);
+
+/* Stops the handle's worker pool and frees the handle; not during a run. */
+void mnf_close(mnf_t *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNF_H */
@@ -6,44 +6,73 @@
 // source directory into a single destination directory.
 //
 // Build:
-//   gcc -O2 -pthread -Wall -Wextra -o mnf src/mnf.c
+//   gcc -O2 -pthread -Wall -Wextra -Iinclude -o mnf src/mnf.c
+// With -DMNF_LIBRARY the file builds libmnf (include/mnf.h) instead of the CLI.
 //
 // See the man page (man/mnf.1) or run: mnf --help
 
 #define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <getopt.h>
 #include <limits.h>
+#include <poll.h>
 #include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/fs.h> // FICLONE
+#endif
+
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
+#include "mnf.h"
+
 #ifndef MNF_VERSION
 #define MNF_VERSION "1.0.0"
 #endif
 
 // ------------------------------ Logging ------------------------------
 static pthread_mutex_t log_mx = PTHREAD_MUTEX_INITIALIZER;
-static int g_verbose = 1; // 0=quiet, 1=info, 2=debug
+// 0=quiet, 1=info, 2=debug; threads take it from the handle they work for.
+static __thread int tls_verbose = 1;
+
+// Set by library calls so that a fatal error returns to them instead of exiting.
+static __thread jmp_buf *tls_die_jmp;
+static __thread char tls_die_msg[256];
 
 static void die(const char *fmt, ...) {
     va_list ap; va_start(ap, fmt);
+    if (tls_die_jmp) {
+        vsnprintf(tls_die_msg, sizeof(tls_die_msg), fmt, ap);
+        va_end(ap);
+        longjmp(*tls_die_jmp, 1);
+    }
     pthread_mutex_lock(&log_mx);
     vfprintf(stderr, fmt, ap); fputc('\n', stderr);
     pthread_mutex_unlock(&log_mx);
@@ -51,8 +80,214 @@ static void die(const char *fmt, ...) {
     exit(EXIT_FAILURE);
 }
 
+static uint64_t now_ns(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// While the run is in progress, output goes through asynchronous sinks:
+// each thread formats records into its own chunk buffer and hands full (or
+// aged) chunks to the sink's lock-free ring; a single writer thread drains
+// all rings with large writev() calls. Outside of that window output is
+// written synchronously under log_mx.
+#define SINK_MAX 4
+#define SINK_RING 256                // chunks per ring
+#define SINK_CHUNK (64 * 1024)       // bytes per chunk
+#define SINK_MAX_AGE_NS 50000000ULL  // publish a partly filled chunk after 50 ms
+
+typedef enum { SINK_BLOCK=0, SINK_DROP=1 } sink_policy_t;
+
+typedef struct {
+    size_t len, cap;
+    unsigned long nrec;
+    char data[];
+} sink_chunk_t;
+
+typedef struct { unsigned long seq; sink_chunk_t *chunk; } sink_cell_t;
+
+typedef struct {
+    int id;                     // index into the thread-local batch table
+    int fd;
+    sink_policy_t policy;
+    bool active, broken;
+    sink_cell_t cells[SINK_RING];
+    unsigned long head __attribute__((aligned(64))); // next enqueue position
+    unsigned long tail __attribute__((aligned(64))); // next dequeue position (writer thread only)
+    unsigned long dropped;      // records lost to a full ring or a failed write
+    unsigned long full_waits;   // times a producer found the ring full and waited (block policy)
+    unsigned long long full_wait_ns;
+} sink_t;
+
+static struct {
+    sink_t *sinks[SINK_MAX]; int n;
+    pthread_t th;
+    bool running, stop;
+} sinkw;
+
+typedef struct { sink_chunk_t *chunk; uint64_t t_first; } sink_batch_t;
+static __thread sink_batch_t tls_batches[SINK_MAX];
+
+static sink_t log_sink = { .fd = STDOUT_FILENO };
+
+#ifndef MNF_LIBRARY
+static void sink_register(sink_t *s, int fd, sink_policy_t policy) {
+    if (sinkw.n == SINK_MAX) die("Too many output sinks");
+    s->id = sinkw.n; s->fd = fd; s->policy = policy;
+    for (unsigned long i=0;i<SINK_RING;i++) s->cells[i].seq = i;
+    sinkw.sinks[sinkw.n++] = s;
+}
+#endif
+
+// Bounded MPMC ring (Vyukov): producers claim a slot with one CAS on 'head'.
+static bool sink_ring_push(sink_t *s, sink_chunk_t *c) {
+    unsigned long pos = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+    for (;;) {
+        sink_cell_t *cell = &s->cells[pos % SINK_RING];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long dif = (long)(seq - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&s->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->chunk = c;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+#ifndef MNF_LIBRARY
+static sink_chunk_t *sink_ring_pop(sink_t *s) {
+    unsigned long pos = s->tail;
+    sink_cell_t *cell = &s->cells[pos % SINK_RING];
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1) return NULL;
+    sink_chunk_t *c = cell->chunk;
+    s->tail = pos + 1;
+    __atomic_store_n(&cell->seq, pos + SINK_RING, __ATOMIC_RELEASE);
+    return c;
+}
+#endif
+
+static void sink_publish(sink_t *s, sink_batch_t *b) {
+    sink_chunk_t *c = b->chunk;
+    if (!c) return;
+    b->chunk = NULL;
+    if (!c->len) { free(c); return; }
+    uint64_t t = 0;
+    while (!sink_ring_push(s, c)) {
+        if (s->policy == SINK_DROP || !__atomic_load_n(&sinkw.running, __ATOMIC_ACQUIRE)) {
+            __atomic_add_fetch(&s->dropped, c->nrec, __ATOMIC_RELAXED);
+            free(c);
+            return;
+        }
+        if (!t) { t = now_ns(); __atomic_add_fetch(&s->full_waits, 1, __ATOMIC_RELAXED); }
+        struct timespec ts = { 0, 100000 }; nanosleep(&ts, NULL);
+    }
+    if (t) __atomic_add_fetch(&s->full_wait_ns, now_ns() - t, __ATOMIC_RELAXED);
+}
+
+// Appends one formatted record (plus '\n') to the calling thread's chunk.
+static void sink_vprintf(sink_t *s, const char *fmt, va_list ap) {
+    sink_batch_t *b = &tls_batches[s->id];
+    for (int attempt = 0;; attempt++) {
+        if (!b->chunk) {
+            size_t cap = SINK_CHUNK;
+            if (attempt > 1) { va_list aq; va_copy(aq, ap); cap = (size_t)vsnprintf(NULL, 0, fmt, aq) + 2; va_end(aq); }
+            b->chunk = (sink_chunk_t *)malloc(sizeof(sink_chunk_t) + cap); if (!b->chunk) die("OOM");
+            b->chunk->len = 0; b->chunk->cap = cap; b->chunk->nrec = 0;
+            b->t_first = now_ns();
+        }
+        sink_chunk_t *c = b->chunk;
+        size_t room = c->cap - c->len;
+        va_list aq; va_copy(aq, ap);
+        int n = vsnprintf(c->data + c->len, room, fmt, aq);
+        va_end(aq);
+        if (n >= 0 && (size_t)n + 1 < room) {
+            c->len += (size_t)n; c->data[c->len++] = '\n'; c->nrec++;
+            if (c->cap - c->len < 1024 || now_ns() - b->t_first > SINK_MAX_AGE_NS) sink_publish(s, b);
+            return;
+        }
+        if (n < 0) return;
+        sink_publish(s, b);
+    }
+}
+
+// Hands the calling thread's pending chunks to the writer; 'aged_only' keeps young ones.
+static void sink_flush_thread(bool aged_only) {
+    uint64_t now = aged_only ? now_ns() : 0;
+    for (int i=0;i<sinkw.n;i++) {
+        sink_batch_t *b = &tls_batches[i];
+        if (b->chunk && (!aged_only || now - b->t_first > SINK_MAX_AGE_NS)) sink_publish(sinkw.sinks[i], b);
+    }
+}
+
+#ifndef MNF_LIBRARY
+static void sink_write_all(sink_t *s, sink_chunk_t **cs, int n) {
+    struct iovec iov[64]; int k = 0; unsigned long nrec = 0;
+    for (int i=0;i<n;i++) { iov[i].iov_base = cs[i]->data; iov[i].iov_len = cs[i]->len; nrec += cs[i]->nrec; }
+    while (k < n && !s->broken) {
+        ssize_t w = writev(s->fd, iov + k, n - k);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) { struct pollfd p = { s->fd, POLLOUT, 0 }; poll(&p, 1, 100); continue; }
+            s->broken = true;
+            break;
+        }
+        while (k < n && (size_t)w >= iov[k].iov_len) { w -= (ssize_t)iov[k].iov_len; k++; }
+        if (k < n) { iov[k].iov_base = (char *)iov[k].iov_base + w; iov[k].iov_len -= (size_t)w; }
+    }
+    if (s->broken) __atomic_add_fetch(&s->dropped, nrec, __ATOMIC_RELAXED);
+    for (int i=0;i<n;i++) free(cs[i]);
+}
+
+static void *sink_writer_main(void *arg) {
+    (void)arg;
+    long idle_us = 0;
+    for (;;) {
+        bool stop = __atomic_load_n(&sinkw.stop, __ATOMIC_ACQUIRE);
+        bool any = false;
+        for (int i=0;i<sinkw.n;i++) {
+            sink_t *s = sinkw.sinks[i];
+            sink_chunk_t *cs[64]; int n = 0;
+            while (n < 64 && (cs[n] = sink_ring_pop(s)) != NULL) n++;
+            if (n) { any = true; sink_write_all(s, cs, n); }
+        }
+        if (any) { idle_us = 0; continue; }
+        if (stop) break;
+        // Nothing queued: back off from 50 us up to 5 ms between polls.
+        idle_us = idle_us ? (idle_us * 2 > 5000 ? 5000 : idle_us * 2) : 50;
+        struct timespec ts = { 0, idle_us * 1000 }; nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+static void sinks_start(void) {
+    for (int i=0;i<sinkw.n;i++) sinkw.sinks[i]->active = true;
+    __atomic_store_n(&sinkw.running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&sinkw.th, NULL, sink_writer_main, NULL) != 0) die("pthread_create failed");
+}
+// Called once all producer threads have flushed; drains everything and returns to synchronous output.
+static void sinks_stop(void) {
+    if (!sinkw.running) return;
+    sink_flush_thread(false);
+    __atomic_store_n(&sinkw.stop, true, __ATOMIC_RELEASE);
+    pthread_join(sinkw.th, NULL);
+    sinkw.running = false;
+    for (int i=0;i<sinkw.n;i++) sinkw.sinks[i]->active = false;
+}
+#endif
+
+static void sink_printf(sink_t *s, const char *fmt, ...) {
+    va_list ap; va_start(ap, fmt);
+    sink_vprintf(s, fmt, ap);
+    va_end(ap);
+}
+
 static void vlogf(int level, const char *fmt, va_list ap) {
-    if (level > g_verbose) return;
+    if (level > tls_verbose) return;
+    if (log_sink.active) { sink_vprintf(&log_sink, fmt, ap); return; }
     pthread_mutex_lock(&log_mx);
     vfprintf(stdout, fmt, ap); fputc('\n', stdout);
     fflush(stdout);
@@ -64,10 +299,273 @@ static void logf(int level, const char *fmt, ...) {
     va_end(ap);
 }
 
+// ------------------------------ Stats ------------------------------
+// Counters are sharded per thread: every thread owns a cache-line aligned slot
+// that only it writes (relaxed atomic stores, no locked instructions), and
+// readers sum all slots on demand.
+typedef enum { PHASE_TRAVERSE=0, PHASE_PLACE=1, PHASE_TRANSFER=2, PHASE_PRUNE=3, PHASE_COUNT } phase_t;
+typedef enum { METHOD_NONE=0, METHOD_RENAME=1, METHOD_COPY=2, METHOD_SYMLINK=3, METHOD_CLONE=4 } move_method_t;
+// Syscall classes counted per phase; the stat and open families are folded together,
+// and readlink counts as stat.
+typedef enum { SC_OPENDIR=0, SC_READDIR, SC_STAT, SC_REALPATH, SC_ACCESS, SC_MKDIR, SC_RENAME, SC_OPEN, SC_READ,
+               SC_WRITE, SC_FSYNC, SC_UNLINK, SC_RMDIR, SC_SYMLINK, SC_OTHER, SC_COUNT } sys_t;
+// Mutex classes whose contention is accounted; all directory locks share one class.
+typedef enum { LOCK_QUEUE=0, LOCK_DEST_TABLE, LOCK_DEST_DIR, LOCK_JOURNAL, LOCK_UNDO, LOCK_SERVE, LOCK_COUNT } lock_class_t;
+#ifndef MNF_LIBRARY
+static const char *const phase_names[PHASE_COUNT] = { "traverse", "place", "transfer", "prune" };
+static const char *const sys_names[SC_COUNT] = { "opendir", "readdir", "stat", "realpath", "access", "mkdir", "rename",
+                                                 "open", "read", "write", "fsync", "unlink", "rmdir", "symlink", "other" };
+static const char *const lock_names[LOCK_COUNT] = { "queue", "dest-table", "dest-dir", "journal", "undo", "serve" };
+#endif
+
+#define SLOW_TOP 10
+
+// Operations timed by op_begin()/op_end().
+typedef enum { OP_OPENDIR=0, OP_LSTAT, OP_PLACE, OP_RENAME, OP_COPY, OP_FSYNC, OP_UNLINK, OP_HASH, OP_COUNT } op_t;
+static const char *const op_names[OP_COUNT] = { "opendir", "lstat", "place", "rename", "copy", "fsync", "unlink", "hash" };
+
+typedef struct stats_slot {
+    unsigned long moved, skipped, failed, deduped;
+    unsigned long renames, copies, clones, symlinks; // how moved files got there
+    unsigned long long bytes_copied;           // bytes written by cross-device copies
+    unsigned long long bytes_renamed;          // size of files moved by rename
+    unsigned long long phase_ns[PHASE_COUNT];  // thread time spent per phase
+    unsigned long queued;                      // files handed to workers by traversal
+    unsigned long long bytes_queued, bytes_done; // their sizes, and those of finished jobs
+    unsigned long lock_acq[LOCK_COUNT], lock_contended[LOCK_COUNT];
+    unsigned long long lock_wait_ns[LOCK_COUNT]; // time spent blocked on contended locks
+    unsigned long idle_waits;                  // pop_job() sleeps on an empty queue
+    unsigned long busy;                        // 1 while this thread is processing a job
+    unsigned long sys[PHASE_COUNT][SC_COUNT];  // syscalls issued, by phase
+    unsigned long long idle_ns;
+    unsigned long *hist;                       // OP_COUNT latency histograms, with op timing only
+    unsigned long long op_ns[OP_COUNT];        // exact latency sums next to the histograms
+    struct slow_file { uint64_t ns; off_t size; char *path; } slowest[SLOW_TOP]; // this thread's slowest jobs
+    struct stats_slot *next;
+    struct stats_slot *retired_next;
+} __attribute__((aligned(64))) stats_slot_t;
+
+static stats_slot_t *stats_slots; // all slots ever registered, pushed lock-free
+// Slots of finished threads, taken over by new ones so that threads started per
+// run (traversal, library handles) do not grow the list.
+static stats_slot_t *stats_retired;
+static pthread_mutex_t stats_retired_mx = PTHREAD_MUTEX_INITIALIZER;
+static __thread stats_slot_t *tls_stats;
+static __thread phase_t tls_phase; // phase the calling thread's syscalls are charged to
+
+// Per-operation latency histograms (--stats=detailed), log-linear in the style
+// of HdrHistogram: values below 16 ns are exact, above that every power of two
+// is split into 16 sub-buckets, so a bucket is at most 1/16 wide relative to
+// its value. Each thread records into the histograms of its own slot.
+#define HIST_SUB 16
+#define HIST_BUCKETS (61 * HIST_SUB)
+static bool g_op_timing;  // op_begin()/op_end() measure (histograms, tracing or slow-op log)
+static bool g_op_hist;    // ... and record into the histograms
+static uint64_t g_slow_ns; // --slow-op-threshold, 0 if off
+
+// What the calling thread is working on, named by the slow-op log. Set right
+// before the operations it covers; may point at a caller's local buffer.
+static __thread const char *tls_op_path;
+static __thread off_t tls_op_bytes = -1;
+
+static void trace_span(const char *name, uint64_t t0, uint64_t t1, const char *path);
+
+// A slot for a thread that has none: a retired one, or a new one.
+static stats_slot_t *stats_slot_new(void) {
+    pthread_mutex_lock(&stats_retired_mx);
+    stats_slot_t *s = stats_retired;
+    if (s) stats_retired = s->retired_next;
+    pthread_mutex_unlock(&stats_retired_mx);
+    if (s) return s;
+    s = (stats_slot_t *)aligned_alloc(64, sizeof(*s)); if (!s) die("OOM");
+    memset(s, 0, sizeof(*s));
+    if (g_op_hist) { s->hist = (unsigned long *)calloc(OP_COUNT * HIST_BUCKETS, sizeof(unsigned long)); if (!s->hist) die("OOM"); }
+    s->next = __atomic_load_n(&stats_slots, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&stats_slots, &s->next, s, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    return s;
+}
+static stats_slot_t *stats_slot(void) {
+    return tls_stats ? tls_stats : (tls_stats = stats_slot_new());
+}
+// Called by a thread that is done counting; its counts stay in the sums.
+static void stats_slot_retire(void) {
+    stats_slot_t *s = tls_stats;
+    if (!s) return;
+    tls_stats = NULL;
+    pthread_mutex_lock(&stats_retired_mx);
+    s->retired_next = stats_retired; stats_retired = s;
+    pthread_mutex_unlock(&stats_retired_mx);
+}
+// Single-writer increment of a field in the calling thread's slot.
+#define STAT_ADD(field, n) do { \
+        stats_slot_t *s_ = stats_slot(); \
+        __atomic_store_n(&s_->field, s_->field + (n), __ATOMIC_RELAXED); \
+    } while (0)
+#define STAT_SET(field, v) __atomic_store_n(&stats_slot()->field, (v), __ATOMIC_RELAXED)
+
+static void add_moved(void) { STAT_ADD(moved, 1); }
+static void add_skipped(void) { STAT_ADD(skipped, 1); }
+static void add_deduped(void) { STAT_ADD(deduped, 1); }
+static void add_failed(void) { STAT_ADD(failed, 1); }
+static void add_bytes(unsigned long long b) { STAT_ADD(bytes_copied, b); }
+static void add_phase(phase_t p, uint64_t ns) { STAT_ADD(phase_ns[p], ns); }
+static void sys_add_in(phase_t p, sys_t k) { STAT_ADD(sys[p][k], 1); }
+static void sys_add(sys_t k) { sys_add_in(tls_phase, k); }
+static void add_method(move_method_t m, off_t size) {
+    if (m == METHOD_RENAME) { STAT_ADD(renames, 1); STAT_ADD(bytes_renamed, (unsigned long long)size); }
+    else if (m == METHOD_COPY) STAT_ADD(copies, 1);
+    else if (m == METHOD_CLONE) STAT_ADD(clones, 1);
+    else if (m == METHOD_SYMLINK) STAT_ADD(symlinks, 1);
+}
+
+static unsigned hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return (unsigned)v;
+    unsigned e = 63u - (unsigned)__builtin_clzll(v); // >= 4
+    return (e - 3) * HIST_SUB + (unsigned)((v >> (e - 4)) & (HIST_SUB - 1));
+}
+#ifndef MNF_LIBRARY
+// Midpoint of a bucket's value range.
+static uint64_t hist_value(unsigned b) {
+    if (b < HIST_SUB) return b;
+    unsigned e = b / HIST_SUB + 3;
+    uint64_t lo = (uint64_t)(HIST_SUB + b % HIST_SUB) << (e - 4);
+    return lo + ((1ULL << (e - 4)) >> 1);
+}
+#endif
+
+// Brackets one operation; costs nothing unless op timing is enabled. op_end()
+// leaves errno alone, so it can sit between a failed call and its error check.
+static uint64_t op_begin(void) { return g_op_timing ? now_ns() : 0; }
+static void op_end(op_t op, uint64_t t0) {
+    if (!t0) return;
+    int e = errno;
+    uint64_t t1 = now_ns();
+    stats_slot_t *s = stats_slot();
+    if (s->hist) {
+        unsigned long *c = &s->hist[(size_t)op * HIST_BUCKETS + hist_bucket(t1 - t0)];
+        __atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->op_ns[op], s->op_ns[op] + (t1 - t0), __ATOMIC_RELAXED);
+    }
+    trace_span(op_names[op], t0, t1, NULL);
+    if (g_slow_ns && t1 - t0 >= g_slow_ns) {
+        if (tls_op_bytes >= 0)
+            logf(1, "SLOW: %s took %.1f ms: '%s' (%lld bytes)", op_names[op], (t1 - t0) / 1e6,
+                 tls_op_path ? tls_op_path : "?", (long long)tls_op_bytes);
+        else
+            logf(1, "SLOW: %s took %.1f ms: '%s'", op_names[op], (t1 - t0) / 1e6, tls_op_path ? tls_op_path : "?");
+    }
+    errno = e;
+}
+
+typedef struct { unsigned long count; uint64_t p50, p99, p999, max, sum; } op_summary_t;
+
+#ifndef MNF_LIBRARY
+// Merges all threads' histograms for 'op'; safe while workers are running.
+static void op_summary(op_t op, op_summary_t *out) {
+    static const double qs[3] = { 0.50, 0.99, 0.999 };
+    uint64_t *ps[3] = { &out->p50, &out->p99, &out->p999 };
+    unsigned long *h = (unsigned long *)calloc(HIST_BUCKETS, sizeof(unsigned long)); if (!h) die("OOM");
+    memset(out, 0, sizeof(*out));
+    for (stats_slot_t *s = __atomic_load_n(&stats_slots, __ATOMIC_ACQUIRE); s; s = s->next) {
+        if (!s->hist) continue;
+        out->sum += __atomic_load_n(&s->op_ns[op], __ATOMIC_RELAXED);
+        for (unsigned b=0;b<HIST_BUCKETS;b++) {
+            unsigned long c = __atomic_load_n(&s->hist[(size_t)op * HIST_BUCKETS + b], __ATOMIC_RELAXED);
+            h[b] += c; out->count += c;
+        }
+    }
+    unsigned long seen = 0; int k = 0;
+    for (unsigned b=0;b<HIST_BUCKETS && out->count;b++) {
+        if (!h[b]) continue;
+        seen += h[b];
+        while (k < 3 && (double)seen >= qs[k] * (double)out->count) *ps[k++] = hist_value(b);
+        out->max = hist_value(b);
+    }
+    free(h);
+}
+
+static void print_op_latency(void) {
+    logf(1, "%-8s %10s %10s %10s %10s %10s", "op", "count", "p50 us", "p99 us", "p999 us", "max us");
+    for (int op=0;op<OP_COUNT;op++) {
+        op_summary_t ls; op_summary((op_t)op, &ls);
+        if (!ls.count) continue;
+        logf(1, "%-8s %10lu %10.1f %10.1f %10.1f %10.1f", op_names[op], ls.count,
+             ls.p50 / 1e3, ls.p99 / 1e3, ls.p999 / 1e3, ls.max / 1e3);
+    }
+}
+
+// Sums all thread slots; safe to call while workers are running.
+static void stats_snapshot(stats_slot_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (stats_slot_t *s = __atomic_load_n(&stats_slots, __ATOMIC_ACQUIRE); s; s = s->next) {
+#define SUM(f) out->f += __atomic_load_n(&s->f, __ATOMIC_RELAXED)
+        SUM(moved); SUM(skipped); SUM(failed); SUM(deduped);
+        SUM(renames); SUM(copies); SUM(clones); SUM(symlinks);
+        SUM(bytes_copied); SUM(bytes_renamed);
+        SUM(queued); SUM(bytes_queued); SUM(bytes_done);
+        SUM(idle_waits); SUM(idle_ns); SUM(busy);
+        for (int p=0;p<PHASE_COUNT;p++) SUM(phase_ns[p]);
+        for (int l=0;l<LOCK_COUNT;l++) { SUM(lock_acq[l]); SUM(lock_contended[l]); SUM(lock_wait_ns[l]); }
+        for (int p=0;p<PHASE_COUNT;p++) for (int k=0;k<SC_COUNT;k++) SUM(sys[p][k]);
+#undef SUM
+    }
+}
+#endif
+
+// pthread_mutex_lock() that counts the acquisition; only contended ones are timed.
+static void mx_lock(pthread_mutex_t *m, lock_class_t c) {
+    if (pthread_mutex_trylock(m) != 0) {
+        uint64_t t = now_ns();
+        pthread_mutex_lock(m);
+        STAT_ADD(lock_contended[c], 1);
+        STAT_ADD(lock_wait_ns[c], now_ns() - t);
+    }
+    STAT_ADD(lock_acq[c], 1);
+}
+
+#ifndef MNF_LIBRARY
+// One line at -v; the per-phase breakdown with --stats=detailed.
+static void print_sys_stats(const stats_slot_t *st, bool detailed) {
+    unsigned long total = 0, per[PHASE_COUNT] = {0};
+    for (int p=0;p<PHASE_COUNT;p++) for (int k=0;k<SC_COUNT;k++) { per[p] += st->sys[p][k]; total += st->sys[p][k]; }
+    if (st->moved) logf(detailed ? 1 : 2, "Syscalls: %lu (%.2f per file moved; %s %lu, %s %lu, %s %lu, %s %lu)",
+                        total, (double)total / (double)st->moved,
+                        phase_names[0], per[0], phase_names[1], per[1], phase_names[2], per[2], phase_names[3], per[3]);
+    else logf(detailed ? 1 : 2, "Syscalls: %lu", total);
+    if (!detailed) return;
+    logf(1, "%-10s %10s %10s %10s %10s", "syscall", phase_names[0], phase_names[1], phase_names[2], phase_names[3]);
+    for (int k=0;k<SC_COUNT;k++) {
+        if (!st->sys[0][k] && !st->sys[1][k] && !st->sys[2][k] && !st->sys[3][k]) continue;
+        logf(1, "%-10s %10lu %10lu %10lu %10lu", sys_names[k], st->sys[0][k], st->sys[1][k], st->sys[2][k], st->sys[3][k]);
+    }
+}
+
+static void print_lock_stats(const stats_slot_t *st) {
+    logf(1, "%-10s %12s %12s %10s", "lock", "acquired", "contended", "wait ms");
+    for (int l=0;l<LOCK_COUNT;l++)
+        logf(1, "%-10s %12lu %12lu %10.1f", lock_names[l], st->lock_acq[l], st->lock_contended[l], st->lock_wait_ns[l] / 1e6);
+    logf(1, "%-10s %12s %12lu %10.1f", "log-ring", "-", log_sink.full_waits, log_sink.full_wait_ns / 1e6);
+    logf(1, "Workers idle on an empty queue: %.3fs (%lu waits)", st->idle_ns / 1e9, st->idle_waits);
+}
+
+static void stats_free(void) {
+    stats_slot_t *s = stats_slots;
+    while (s) {
+        stats_slot_t *next = s->next;
+        for (int i=0;i<SLOW_TOP;i++) free(s->slowest[i].path);
+        free(s->hist); free(s);
+        s = next;
+    }
+    stats_slots = stats_retired = NULL;
+}
+#endif
+
 // ------------------------------ Small utils ------------------------------
-static void path_join(char *dst, size_t dstsz, const char *a, const char *b) {
-    if (snprintf(dst, dstsz, "%s/%s", a, b) >= (int)dstsz)
-        die("Path too long: '%s' + '%s'", a, b);
+// Returns false with errno ENAMETOOLONG if 'a/b' does not fit.
+static bool path_join(char *dst, size_t dstsz, const char *a, const char *b) {
+    if (snprintf(dst, dstsz, "%s/%s", a, b) < (int)dstsz) return true;
+    errno = ENAMETOOLONG;
+    return false;
 }
 static const char *basename_const(const char *path) {
     const char *s = strrchr(path, '/');
@@ -99,6 +597,15 @@ static char **split_csv(const char *csv, size_t *out_count) {
     free(tmp);
     *out_count = cnt; return arr;
 }
+static bool write_full(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) { if (errno == EINTR) continue; return false; }
+        buf += w; len -= (size_t)w;
+    }
+    return true;
+}
+
 static void free_strv(char **v, size_t n) { if (!v) return; for (size_t i=0;i<n;i++) free(v[i]); free(v); }
 
 static bool parse_size(const char *s, off_t *out) {
@@ -120,6 +627,22 @@ static bool parse_size(const char *s, off_t *out) {
     *out = (off_t)(val * mult);
     return true;
 }
+// Durations: a number with ns, us, ms (default), s or m, e.g. 500ms or 2s.
+static bool parse_duration(const char *s, uint64_t *out_ns) {
+    if (!s || !*s) return false;
+    char *end = NULL; errno = 0;
+    double val = strtod(s, &end);
+    if (errno != 0 || end == s || val < 0) return false;
+    double mult;
+    if (strcmp(end, "ns") == 0) mult = 1.0;
+    else if (strcmp(end, "us") == 0) mult = 1e3;
+    else if (strcmp(end, "ms") == 0 || !*end) mult = 1e6;
+    else if (strcmp(end, "s") == 0) mult = 1e9;
+    else if (strcmp(end, "m") == 0) mult = 60e9;
+    else return false;
+    *out_ns = (uint64_t)(val * mult);
+    return true;
+}
 static bool parse_time_spec(const char *s, time_t *out) {
     if (!s || !*s) return false;
     struct tm tmv; memset(&tmv, 0, sizeof(tmv));
@@ -143,12 +666,78 @@ static bool parse_time_spec(const char *s, time_t *out) {
     return true;
 }
 
+// Writes s as the body of a JSON string. Quotes, backslashes and control bytes
+// are escaped; bytes >= 0x80 pass through, as paths need not be valid UTF-8.
+static void json_escape(const char *s, char *out, size_t outsz) {
+    size_t n = 0;
+    for (; *s && n + 7 < outsz; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') { out[n++] = '\\'; out[n++] = (char)c; }
+        else if (c == '\n') { out[n++] = '\\'; out[n++] = 'n'; }
+        else if (c == '\t') { out[n++] = '\\'; out[n++] = 't'; }
+        else if (c < 0x20 || c == 0x7f) n += (size_t)snprintf(out + n, outsz - n, "\\u%04x", c);
+        else out[n++] = (char)c;
+    }
+    out[n] = '\0';
+}
+
+// ------------------------------ Tracing ------------------------------
+// --trace FILE: a Chrome trace-event timeline (chrome://tracing, Perfetto).
+// Spans are "complete" events formatted into per-thread sink buffers and
+// written by the sink writer thread, so tracing adds no shared writes. The
+// file is a JSON array; its header and closing bracket are written
+// synchronously around the run.
+static sink_t trace_sink = { .fd = -1 };
+static uint64_t trace_t0;
+static int trace_pid;
+static int trace_next_tid;
+static __thread int tls_trace_tid;
+
+// Names the calling thread in the timeline.
+static void trace_thread(const char *name) {
+    if (!trace_sink.active) return;
+    tls_trace_tid = __atomic_add_fetch(&trace_next_tid, 1, __ATOMIC_RELAXED);
+    sink_printf(&trace_sink, ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                trace_pid, tls_trace_tid, name, tls_trace_tid);
+}
+
+// Records a span from t0 to t1 (now_ns() clock); 'path' becomes an argument if given.
+static __thread char tls_trace_esc[PATH_MAX * 6]; // escaped path, kept off the worker stacks
+static void trace_span(const char *name, uint64_t t0, uint64_t t1, const char *path) {
+    if (!trace_sink.active) return;
+    char *esc = tls_trace_esc;
+    esc[0] = '\0';
+    if (path) json_escape(path, esc, sizeof(tls_trace_esc));
+    sink_printf(&trace_sink, ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f%s%s%s}",
+                name, trace_pid, tls_trace_tid, (double)(t0 - trace_t0) / 1e3, (double)(t1 - t0) / 1e3,
+                path ? ",\"args\":{\"path\":\"" : "", esc, path ? "\"}" : "");
+}
+
+#ifndef MNF_LIBRARY
+static int trace_open(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) die("Cannot open trace file: %s (%s)", path, strerror(errno));
+    trace_t0 = now_ns();
+    trace_pid = (int)getpid();
+    dprintf(fd, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"mnf\"}}\n", trace_pid);
+    return fd;
+}
+static void trace_close(void) {
+    if (trace_sink.fd < 0) return;
+    dprintf(trace_sink.fd, "]\n");
+    close(trace_sink.fd);
+}
+#endif
+
 // ------------------------------ Options ------------------------------
-typedef enum { MODE_RENAME=0, MODE_SKIP=1, MODE_OVERWRITE=2 } mode_tg;
+typedef enum { MODE_RENAME=0, MODE_SKIP=1, MODE_OVERWRITE=2, MODE_DEDUP=3 } mode_tg;
+typedef enum { LAYOUT_FLAT=0, LAYOUT_CAS=1 } layout_kind_t;
+typedef enum { SHARD_NONE=0, SHARD_HASH=1, SHARD_DATE=2, SHARD_EXT=3 } shard_kind_t;
 
 typedef struct {
     char *src; char *dst;
     int threads;
+    int verbose;                // 0=quiet, 1=info, 2=debug
     mode_tg mode;
     int min_depth;
     int max_depth;
@@ -157,6 +746,31 @@ typedef struct {
     bool preserve_times;
     bool include_symlinks;
     bool prune_empty_dirs;
+    bool ignore_files;
+    sink_policy_t log_policy;
+    char *events;               // --events=json:TARGET, NULL if off
+    bool stats_detailed;
+    char *trace;                // --trace FILE
+    uint64_t slow_ns;           // --slow-op-threshold, 0 if off
+    char *metrics_file;         // --metrics-file FILE
+    char *metrics_socket;       // --metrics-socket PATH
+    uint64_t metrics_interval_ns;
+    char *plan_out;             // --plan-out FILE (implies --dry-run)
+    char *plan_in;              // --plan-in FILE
+    char *journal;              // --journal FILE
+    bool resume;
+    char *undo_log;             // --undo-log FILE
+    bool undo_sync;             // --undo-sync
+    char *undo;                 // --undo FILE
+    char *state;                // --state FILE
+    bool watch;                 // --watch
+    char *serve;                // --serve SOCKET
+    char **sources; size_t n_sources;  // SOURCE_DIR... and --sources-from; src is the first
+    char *sources_from;         // --sources-from FILE
+    char **device_limits; size_t n_device_limits;  // --device-limit KEY=N
+
+    layout_kind_t layout;
+    shard_kind_t shard; unsigned shard_buckets; char *shard_datefmt;
 
     off_t min_size; bool has_min_size;
     off_t max_size; bool has_max_size;
@@ -170,31 +784,82 @@ typedef struct {
 } options_t;
 
 static void print_usage_short(const char *prog) {
-    fprintf(stderr, "Usage: %s SOURCE_DIR DEST_DIR [options]\n", prog);
+    fprintf(stderr, "Usage: %s SOURCE_DIR... DEST_DIR [options]\n       %s --plan-in FILE [options]\n"
+                    "       %s --undo FILE [options]\n       %s --serve SOCKET [options]\n", prog, prog, prog, prog);
     fprintf(stderr, "Try '%s --help' for a full description.\n", prog);
 }
+static void usage_error(const char *prog) {
+    if (tls_die_jmp) die("Invalid option or unexpected argument");
+    print_usage_short(prog);
+    exit(2);
+}
 
 static void print_help(const char *prog) {
     printf(
 "move-nested-files (mnf) %s\n"
 "\n"
 "Usage:\n"
-"  %s SOURCE_DIR DEST_DIR [options]\n"
+"  %s SOURCE_DIR... DEST_DIR [options]\n"
+"  %s --plan-in FILE [options]\n"
+"  %s --undo FILE [options]\n"
+"  %s --serve SOCKET [options]\n"
 "\n"
 "Description:\n"
 "  Recursively move files from nested subdirectories under SOURCE_DIR into DEST_DIR.\n"
 "  Files located directly in SOURCE_DIR are left in place by default (min-depth=1).\n"
+"  Several sources are read in parallel into one queue and one DEST_DIR.\n"
 "\n"
 "Core options:\n"
-"  --mode=rename|skip|overwrite   Collision handling (default: rename)\n"
+"  --mode=rename|skip|overwrite|dedup\n"
+"                                 Collision handling (default: rename); dedup drops\n"
+"                                 sources identical to an existing target\n"
 "  -n, --dry-run                  Show actions without changing anything\n"
 "  -t, --threads N                Number of worker threads (default: 1)\n"
 "  -v, --verbose                  More output (repeat for debug)\n"
 "  -q, --quiet                    Less output\n"
-"      --progress                 Show per-file copy progress\n"
+"      --log-policy=block|drop    When log or event output falls behind: wait, or\n"
+"                                 drop and count records (default: block)\n"
+"      --events=json:TARGET       Write one JSON record per file and a final summary\n"
+"                                 to TARGET: a file, '-' (stdout) or fd:N\n"
+"      --stats=summary|detailed   detailed: also report per-operation latency\n"
+"                                 percentiles (p50/p99/p999)\n"
+"      --trace FILE               Write a Chrome trace-event timeline (Perfetto)\n"
+"      --slow-op-threshold=T      Log single operations slower than T (e.g. 500ms,\n"
+"                                 2s) and list the slowest files at the end\n"
+"      --metrics-file FILE        Keep an OpenMetrics/Prometheus textfile up to date\n"
+"      --metrics-interval T       How often to rewrite it (default: 10s)\n"
+"      --metrics-socket PATH      Also serve the metrics over HTTP on a unix socket\n"
+"      --plan-out FILE            Dry run that saves the resolved moves as a plan\n"
+"      --plan-in FILE             Execute a saved plan: no traversal, no filters;\n"
+"                                 SOURCE_DIR, DEST_DIR, --mode and --layout come\n"
+"                                 from the plan\n"
+"      --journal FILE             Log copies crash-safely (group-committed)\n"
+"      --resume                   Recover the copies a killed run left unfinished\n"
+"                                 in the journal, then continue\n"
+"      --undo-log FILE            Record every move for --undo before it is made\n"
+"      --undo-sync                Wait until each record is on disk, so that the\n"
+"                                 log also survives a system crash (slower)\n"
+"      --undo FILE                Roll back the run recorded in FILE\n"
+"      --state FILE               Remember unchanged directories in FILE and do\n"
+"                                 not read them again on the next run\n"
+"      --watch                    Stay resident after the first pass and move new\n"
+"                                 files as they are written (until Ctrl-C)\n"
+"      --serve SOCKET             Stay resident and run move requests received on\n"
+"                                 a unix socket (see the manual page)\n"
+"      --sources-from FILE        Read more source directories from FILE, one per\n"
+"                                 line ('-': stdin)\n"
+"      --device-limit KEY=N       Run at most N jobs at once on a device: hdd=N\n"
+"                                 (rotational disks), other=N or PATH=N for the\n"
+"                                 device of PATH (default: unlimited)\n"
+"      --progress                 Show aggregate progress, rates and ETA on stderr\n"
 "      --no-preserve-times        Do not preserve atime/mtime when copying\n"
 "      --include-symlinks         Move symlink files too (recreate links in DEST)\n"
-"      --prune-empty-dirs         Remove empty directories in SOURCE afterwards\n"
+"      --prune-empty-dirs         Remove SOURCE directories as they become empty\n"
+"      --no-ignore-files          Do not read per-directory .mnfignore files\n"
+"      --layout=flat|cas          cas: name files by content digest; an existing\n"
+"                                 target means identical content (--mode ignored)\n"
+"      --shard=SPEC               Spread DEST over subdirectories: hash:N, date:FMT\n"
+"                                 (strftime of mtime, e.g. date:%%Y/%%m) or ext\n"
 "\n"
 "Depth control:\n"
 "      --min-depth N              Minimum depth to move (default: 1)\n"
@@ -218,7 +883,8 @@ static void print_help(const char *prog) {
 "  %s ./src ./flat\n"
 "  %s ./src ./flat --threads 4 --include \"**/*.jpg,**/*.png\" --min-size 1M --progress\n"
 "  %s ./src ./flat --dry-run --exclude \"**/tmp/**\"\n"
-"\n", MNF_VERSION, prog, prog, prog, prog);
+"  %s ./src ./flat --plan-out night.plan && %s --plan-in night.plan -t 8\n"
+"\n", MNF_VERSION, prog, prog, prog, prog, prog, prog, prog, prog, prog);
 }
 
 static void print_version(void) {
@@ -235,75 +901,276 @@ static void add_patterns(char ***arr, size_t *cnt, const char *csv) {
     free(v);
 }
 static void add_exts(char ***arr, size_t *cnt, const char *csv) { add_patterns(arr, cnt, csv); }
+static void add_string(char ***arr, size_t *cnt, const char *s) {
+    *arr = (char **)realloc(*arr, (*cnt + 1) * sizeof(char *));
+    if (!*arr) die("OOM");
+    (*arr)[(*cnt)++] = xstrdup(s);
+}
+
+// --sources-from FILE: one source directory per line, '-' reads standard input.
+static void add_sources_from(const char *path, options_t *o) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) die("Cannot open '%s' (%s)", path, strerror(errno));
+    char *line = NULL; size_t cap = 0; ssize_t n;
+    while ((n = getline(&line, &cap, f)) >= 0) {
+        while (n && (line[n-1] == '\n' || line[n-1] == '\r')) line[--n] = '\0';
+        if (n) add_string(&o->sources, &o->n_sources, line);
+    }
+    free(line);
+    if (f != stdin) fclose(f);
+}
+
+static void parse_shard(const char *spec, options_t *o) {
+    if (strcmp(spec, "ext") == 0) { o->shard = SHARD_EXT; return; }
+    if (strncmp(spec, "hash:", 5) == 0) {
+        char *end = NULL; errno = 0;
+        unsigned long n = strtoul(spec + 5, &end, 10);
+        if (errno || end == spec + 5 || *end || n < 2 || n > 1000000) die("Invalid --shard bucket count: %s", spec);
+        o->shard = SHARD_HASH; o->shard_buckets = (unsigned)n;
+        return;
+    }
+    if (strncmp(spec, "date:", 5) == 0) {
+        const char *fmt = spec + 5;
+        while (*fmt == '/') fmt++;
+        if (!*fmt || strstr(fmt, "..")) die("Invalid --shard date format: %s", spec);
+        o->shard = SHARD_DATE; o->shard_datefmt = xstrdup(fmt);
+        return;
+    }
+    die("Invalid --shard: %s (expected hash:N, date:FMT or ext)", spec);
+}
+
+static const struct option longopts[] = {
+    {"mode", required_argument, 0, 1000},
+    {"dry-run", no_argument, 0, 'n'},
+    {"threads", required_argument, 0, 't'},
+    {"verbose", no_argument, 0, 'v'},
+    {"quiet", no_argument, 0, 'q'},
+    {"progress", no_argument, 0, 1001},
+    {"no-preserve-times", no_argument, 0, 1002},
+    {"include-symlinks", no_argument, 0, 1003},
+    {"prune-empty-dirs", no_argument, 0, 1004},
+    {"min-depth", required_argument, 0, 1005},
+    {"max-depth", required_argument, 0, 1006},
+    {"include", required_argument, 0, 1007},
+    {"exclude", required_argument, 0, 1008},
+    {"allow-ext", required_argument, 0, 1009},
+    {"deny-ext", required_argument, 0, 1010},
+    {"min-size", required_argument, 0, 1011},
+    {"max-size", required_argument, 0, 1012},
+    {"newer-than", required_argument, 0, 1013},
+    {"older-than", required_argument, 0, 1014},
+    {"no-ignore-files", no_argument, 0, 1015},
+    {"shard", required_argument, 0, 1016},
+    {"layout", required_argument, 0, 1017},
+    {"log-policy", required_argument, 0, 1018},
+    {"events", required_argument, 0, 1019},
+    {"stats", required_argument, 0, 1020},
+    {"trace", required_argument, 0, 1021},
+    {"slow-op-threshold", required_argument, 0, 1022},
+    {"metrics-file", required_argument, 0, 1023},
+    {"metrics-interval", required_argument, 0, 1024},
+    {"metrics-socket", required_argument, 0, 1025},
+    {"plan-out", required_argument, 0, 1026},
+    {"plan-in", required_argument, 0, 1027},
+    {"journal", required_argument, 0, 1028},
+    {"resume", no_argument, 0, 1029},
+    {"undo-log", required_argument, 0, 1030},
+    {"undo", required_argument, 0, 1031},
+    {"state", required_argument, 0, 1032},
+    {"watch", no_argument, 0, 1033},
+    {"serve", required_argument, 0, 1034},
+    {"sources-from", required_argument, 0, 1035},
+    {"device-limit", required_argument, 0, 1036},
+    {"undo-sync", no_argument, 0, 1037},
+    {"help", no_argument, 0, 'h'},
+    {"version", no_argument, 0, 'V'},
+    {0,0,0,0}
+};
 
-static void parse_options(int argc, char **argv, options_t *o) {
+// Options that select what one run moves and how: they can also be given per
+// --serve request (see serve_parse()).
+static bool is_run_option(int opt) { return opt == 1000 || (opt >= 1005 && opt <= 1014); }
+
+static const char *option_name(int opt) {
+    for (const struct option *l = longopts; l->name; l++) if (l->val == opt) return l->name;
+    return "?";
+}
+
+// Sets one of the is_run_option() options; false if 'arg' is not valid for it.
+static bool set_run_option(options_t *o, int opt, const char *arg) {
+    switch (opt) {
+        case 1000:
+            if (strcmp(arg, "rename") == 0) o->mode = MODE_RENAME;
+            else if (strcmp(arg, "skip") == 0) o->mode = MODE_SKIP;
+            else if (strcmp(arg, "overwrite") == 0) o->mode = MODE_OVERWRITE;
+            else if (strcmp(arg, "dedup") == 0) o->mode = MODE_DEDUP;
+            else return false;
+            return true;
+        case 1005: o->min_depth = atoi(arg); if (o->min_depth < 0) o->min_depth = 0; return true;
+        case 1006: o->max_depth = atoi(arg); return true;
+        case 1007: add_patterns(&o->includes, &o->n_includes, arg); return true;
+        case 1008: add_patterns(&o->excludes, &o->n_excludes, arg); return true;
+        case 1009: add_exts(&o->allow_ext, &o->n_allow_ext, arg); return true;
+        case 1010: add_exts(&o->deny_ext, &o->n_deny_ext, arg); return true;
+        case 1011: return (o->has_min_size = parse_size(arg, &o->min_size));
+        case 1012: return (o->has_max_size = parse_size(arg, &o->max_size));
+        case 1013: return (o->has_newer = parse_time_spec(arg, &o->newer_than));
+        case 1014: return (o->has_older = parse_time_spec(arg, &o->older_than));
+    }
+    return false;
+}
+
+// 'library': parsing for mnf_open(), without SOURCE_DIR or DEST_DIR.
+static void parse_options(int argc, char **argv, options_t *o, bool library) {
     memset(o, 0, sizeof(*o));
     o->threads = 1;
+    o->verbose = library ? 0 : 1; // library: quiet unless -v
     o->mode = MODE_RENAME;
     o->min_depth = 1; o->max_depth = -1;
     o->preserve_times = true;
+    o->ignore_files = true;
+    o->metrics_interval_ns = 10000000000ULL;
 
-    static struct option longopts[] = {
-        {"mode", required_argument, 0, 1000},
-        {"dry-run", no_argument, 0, 'n'},
-        {"threads", required_argument, 0, 't'},
-        {"verbose", no_argument, 0, 'v'},
-        {"quiet", no_argument, 0, 'q'},
-        {"progress", no_argument, 0, 1001},
-        {"no-preserve-times", no_argument, 0, 1002},
-        {"include-symlinks", no_argument, 0, 1003},
-        {"prune-empty-dirs", no_argument, 0, 1004},
-        {"min-depth", required_argument, 0, 1005},
-        {"max-depth", required_argument, 0, 1006},
-        {"include", required_argument, 0, 1007},
-        {"exclude", required_argument, 0, 1008},
-        {"allow-ext", required_argument, 0, 1009},
-        {"deny-ext", required_argument, 0, 1010},
-        {"min-size", required_argument, 0, 1011},
-        {"max-size", required_argument, 0, 1012},
-        {"newer-than", required_argument, 0, 1013},
-        {"older-than", required_argument, 0, 1014},
-        {"help", no_argument, 0, 'h'},
-        {"version", no_argument, 0, 'V'},
-        {0,0,0,0}
-    };
 
     int c;
     while ((c = getopt_long(argc, argv, "hqnvt:V", longopts, NULL)) != -1) {
         switch (c) {
-            case 'h': print_help(argv[0]); exit(0);
-            case 'V': print_version(); exit(0);
-            case 'q': g_verbose = 0; break;
-            case 'v': g_verbose++; break;
+            case 'h': if (tls_die_jmp) usage_error(argv[0]); print_help(argv[0]); exit(0);
+            case 'V': if (tls_die_jmp) usage_error(argv[0]); print_version(); exit(0);
+            case 'q': o->verbose = 0; break;
+            case 'v': o->verbose++; break;
             case 'n': o->dry_run = true; break;
             case 't': o->threads = atoi(optarg); if (o->threads < 1) o->threads = 1; break;
-            case 1000:
-                if (strcmp(optarg, "rename") == 0) o->mode = MODE_RENAME;
-                else if (strcmp(optarg, "skip") == 0) o->mode = MODE_SKIP;
-                else if (strcmp(optarg, "overwrite") == 0) o->mode = MODE_OVERWRITE;
-                else die("Invalid --mode: %s", optarg);
+            case 1000: case 1005: case 1006: case 1007: case 1008: case 1009:
+            case 1010: case 1011: case 1012: case 1013: case 1014:
+                if (!set_run_option(o, c, optarg)) die("Invalid --%s: %s", option_name(c), optarg);
                 break;
             case 1001: o->progress = true; break;
             case 1002: o->preserve_times = false; break;
             case 1003: o->include_symlinks = true; break;
             case 1004: o->prune_empty_dirs = true; break;
-            case 1005: o->min_depth = atoi(optarg); if (o->min_depth < 0) o->min_depth = 0; break;
-            case 1006: o->max_depth = atoi(optarg); break;
-            case 1007: add_patterns(&o->includes, &o->n_includes, optarg); break;
-            case 1008: add_patterns(&o->excludes, &o->n_excludes, optarg); break;
-            case 1009: add_exts(&o->allow_ext, &o->n_allow_ext, optarg); break;
-            case 1010: add_exts(&o->deny_ext, &o->n_deny_ext, optarg); break;
-            case 1011: o->has_min_size = parse_size(optarg, &o->min_size); if (!o->has_min_size) die("Invalid --min-size: %s", optarg); break;
-            case 1012: o->has_max_size = parse_size(optarg, &o->max_size); if (!o->has_max_size) die("Invalid --max-size: %s", optarg); break;
-            case 1013: o->has_newer = parse_time_spec(optarg, &o->newer_than); if (!o->has_newer) die("Invalid --newer-than: %s", optarg); break;
-            case 1014: o->has_older = parse_time_spec(optarg, &o->older_than); if (!o->has_older) die("Invalid --older-than: %s", optarg); break;
-            default: print_usage_short(argv[0]); exit(2);
+            case 1015: o->ignore_files = false; break;
+            case 1016: parse_shard(optarg, o); break;
+            case 1017:
+                if (strcmp(optarg, "flat") == 0) o->layout = LAYOUT_FLAT;
+                else if (strcmp(optarg, "cas") == 0) o->layout = LAYOUT_CAS;
+                else die("Invalid --layout: %s", optarg);
+                break;
+            case 1018:
+                if (strcmp(optarg, "block") == 0) o->log_policy = SINK_BLOCK;
+                else if (strcmp(optarg, "drop") == 0) o->log_policy = SINK_DROP;
+                else die("Invalid --log-policy: %s", optarg);
+                break;
+            case 1019:
+                if (strncmp(optarg, "json:", 5) != 0 || !optarg[5]) die("Invalid --events: %s (expected json:TARGET)", optarg);
+                o->events = optarg + 5;
+                break;
+            case 1020:
+                if (strcmp(optarg, "summary") == 0) o->stats_detailed = false;
+                else if (strcmp(optarg, "detailed") == 0) o->stats_detailed = true;
+                else die("Invalid --stats: %s", optarg);
+                break;
+            case 1021: o->trace = optarg; break;
+            case 1022: if (!parse_duration(optarg, &o->slow_ns) || !o->slow_ns) die("Invalid --slow-op-threshold: %s", optarg); break;
+            case 1023: o->metrics_file = optarg; break;
+            case 1024:
+                if (!parse_duration(optarg, &o->metrics_interval_ns) || o->metrics_interval_ns < 100000000ULL)
+                    die("Invalid --metrics-interval: %s", optarg);
+                break;
+            case 1025: o->metrics_socket = optarg; break;
+            case 1026: o->plan_out = optarg; break;
+            case 1027: o->plan_in = optarg; break;
+            case 1028: o->journal = optarg; break;
+            case 1029: o->resume = true; break;
+            case 1030: o->undo_log = optarg; break;
+            case 1031: o->undo = optarg; break;
+            case 1032: o->state = optarg; break;
+            case 1033: o->watch = true; break;
+            case 1034: o->serve = optarg; break;
+            case 1035: o->sources_from = optarg; break;
+            case 1036: add_patterns(&o->device_limits, &o->n_device_limits, optarg); break;
+            case 1037: o->undo_sync = true; break;
+            default: usage_error(argv[0]);
         }
     }
 
-    if (optind + 2 != argc) { print_usage_short(argv[0]); exit(2); }
-    o->src = argv[optind];
-    o->dst = argv[optind+1];
+    if (o->resume && !o->journal) die("--resume needs --journal");
+    if (o->undo_sync && !o->undo_log) die("--undo-sync needs --undo-log");
+    if (o->journal && (o->dry_run || o->plan_out)) die("--journal cannot be used with a dry run");
+    if ((o->state || o->watch) && (o->undo || o->plan_in))
+        die("--%s needs a traversal and cannot be used with --%s", o->state ? "state" : "watch", o->undo ? "undo" : "plan-in");
+    if (o->undo && (o->plan_in || o->plan_out)) die("--undo cannot be combined with a plan");
+    if (o->undo && o->prune_empty_dirs) die("--prune-empty-dirs cannot be used with --undo");
+    if (o->plan_in && o->plan_out) die("--plan-in and --plan-out are mutually exclusive");
+    if (o->plan_in && o->prune_empty_dirs) die("--prune-empty-dirs needs a traversal and cannot be used with --plan-in");
+    if (o->plan_out) o->dry_run = true;
+    if (library) {
+        if (optind != argc || o->sources_from) usage_error(argv[0]);
+        return; // SOURCE_DIR and DEST_DIR come with each run
+    }
+    if (o->serve) {
+        if (o->undo || o->plan_in || o->plan_out || o->state || o->watch)
+            die("--serve cannot be combined with --undo, plans, --state or --watch");
+        if (optind != argc || o->sources_from) usage_error(argv[0]);
+        return; // SOURCE_DIR and DEST_DIR come with each request
+    }
+    if (o->undo || o->plan_in) {
+        if (optind != argc || o->sources_from) usage_error(argv[0]);
+        return; // SOURCE_DIR and DEST_DIR come from the plan; --undo needs none
+    }
+    if (optind + (o->sources_from ? 1 : 2) > argc) usage_error(argv[0]);
+    for (int i=optind;i<argc-1;i++) add_string(&o->sources, &o->n_sources, argv[i]);
+    if (o->sources_from) add_sources_from(o->sources_from, o);
+    if (!o->n_sources) die("No source directories in %s", o->sources_from);
+    o->src = o->sources[0];
+    o->dst = argv[argc-1];
+    if (o->watch && o->dry_run) die("--watch cannot be used with a dry run");
+    if (o->watch && o->prune_empty_dirs) die("--prune-empty-dirs cannot be used with --watch");
+}
+
+#ifdef MNF_LIBRARY
+// mnf_options_t of libmnf, checked like their command-line forms.
+_Static_assert((int)MNF_MODE_DEDUP == (int)MODE_DEDUP && (int)MNF_MODE_SKIP == (int)MODE_SKIP, "mnf_mode_t");
+_Static_assert((int)MNF_LAYOUT_CAS == (int)LAYOUT_CAS, "mnf_layout_t");
+
+static void options_from(const mnf_options_t *p, options_t *o) {
+    memset(o, 0, sizeof(*o));
+    o->threads = p->threads < 1 ? 1 : p->threads;
+    o->verbose = p->verbose;
+    if (p->mode < MNF_MODE_RENAME || p->mode > MNF_MODE_DEDUP) die("Invalid mode: %d", (int)p->mode);
+    o->mode = (mode_tg)p->mode;
+    if (p->layout != MNF_LAYOUT_FLAT && p->layout != MNF_LAYOUT_CAS) die("Invalid layout: %d", (int)p->layout);
+    o->layout = (layout_kind_t)p->layout;
+    if (p->shard) parse_shard(p->shard, o);
+    o->min_depth = p->min_depth < 0 ? 0 : p->min_depth;
+    o->max_depth = p->max_depth;
+    add_patterns(&o->includes, &o->n_includes, p->include);
+    add_patterns(&o->excludes, &o->n_excludes, p->exclude);
+    add_exts(&o->allow_ext, &o->n_allow_ext, p->allow_ext);
+    add_exts(&o->deny_ext, &o->n_deny_ext, p->deny_ext);
+    if ((o->has_min_size = p->min_size >= 0)) o->min_size = (off_t)p->min_size;
+    if ((o->has_max_size = p->max_size >= 0)) o->max_size = (off_t)p->max_size;
+    if ((o->has_newer = p->newer_than >= 0)) o->newer_than = (time_t)p->newer_than;
+    if ((o->has_older = p->older_than >= 0)) o->older_than = (time_t)p->older_than;
+    o->dry_run = p->dry_run;
+    o->include_symlinks = p->include_symlinks;
+    o->prune_empty_dirs = p->prune_empty_dirs;
+    o->preserve_times = p->preserve_times;
+    o->ignore_files = p->ignore_files;
+    add_patterns(&o->device_limits, &o->n_device_limits, p->device_limit);
+    o->metrics_interval_ns = 10000000000ULL;
+}
+#endif
+
+// Frees what parse_options() or options_from() allocated.
+static void options_free(options_t *o) {
+    free_strv(o->includes, o->n_includes);
+    free_strv(o->excludes, o->n_excludes);
+    free_strv(o->allow_ext, o->n_allow_ext);
+    free_strv(o->deny_ext, o->n_deny_ext);
+    free_strv(o->sources, o->n_sources);
+    free_strv(o->device_limits, o->n_device_limits);
+    free(o->shard_datefmt);
 }
 
 // ------------------------------ Filters ------------------------------
@@ -345,6 +1212,14 @@ static bool match_any_exclude(const char *rel, char **globs, size_t n) {
     }
     return false;
 }
+// Size and age: the filters that can change their verdict without a rename.
+static bool file_passes_attr_filters(const options_t *o, const struct stat *st) {
+    if (o->has_min_size && st->st_size < o->min_size) return false;
+    if (o->has_max_size && st->st_size > o->max_size) return false;
+    if (o->has_newer && st->st_mtime < o->newer_than) return false;
+    if (o->has_older && st->st_mtime > o->older_than) return false;
+    return true;
+}
 static bool file_passes_filters(const options_t *o, const char *rel, const struct stat *st, const char *name) {
     if (o->n_includes > 0 && !match_any_glob(rel, o->includes, o->n_includes)) return false;
     if (match_any_exclude(rel, o->excludes, o->n_excludes)) return false;
@@ -353,317 +1228,4025 @@ static bool file_passes_filters(const options_t *o, const char *rel, const struc
         if (!ext || !list_contains_ci(o->allow_ext, o->n_allow_ext, ext)) return false;
     }
     if (ext && o->n_deny_ext > 0 && list_contains_ci(o->deny_ext, o->n_deny_ext, ext)) return false;
-    if (o->has_min_size && st->st_size < o->min_size) return false;
-    if (o->has_max_size && st->st_size > o->max_size) return false;
-    if (o->has_newer && st->st_mtime < o->newer_than) return false;
-    if (o->has_older && st->st_mtime > o->older_than) return false;
-    return true;
+    return file_passes_attr_filters(o, st);
 }
 
-// ------------------------------ Unique naming ------------------------------
-static pthread_mutex_t name_mx = PTHREAD_MUTEX_INITIALIZER;
-static void split_name(const char *name, char *base, size_t bsz, char *ext, size_t extsz) {
-    const char *dot = strrchr(name, '.');
-    if (name[0]=='.' && (!dot || dot==name)) {
-        snprintf(base, bsz, "%s", name); ext[0] = '\0';
-    } else if (dot && dot != name) {
-        size_t blen = (size_t)(dot - name);
-        snprintf(base, bsz, "%.*s", (int)blen, name);
-        snprintf(ext, extsz, "%s", dot);
-    } else {
-        snprintf(base, bsz, "%s", name); ext[0] = '\0';
-    }
+// ------------------------------ Ignore files ------------------------------
+// Per-directory .mnfignore files with gitignore semantics. Each directory's
+// rules are compiled once when traversal enters it and stacked on the parent's
+// set; deeper files take precedence and, within a file, the last match wins.
+#define IGNORE_FILE_NAME ".mnfignore"
+
+typedef enum { IG_GLOB=0, IG_LITERAL=1, IG_SUFFIX=2 } ignore_kind_t;
+
+typedef struct {
+    char *pat;          // pattern without '!', leading '/' and trailing '/'
+    ignore_kind_t kind; // IG_SUFFIX: unanchored '*<literal>', pat holds the literal
+    size_t len;
+    bool negate;        // '!pattern' re-includes
+    bool dir_only;      // 'pattern/' only matches directories
+    bool anchored;      // contains '/': match against the path below the ignore file's dir
+} ignore_rule_t;
+
+typedef struct ignore_set {
+    const struct ignore_set *parent;
+    size_t base_len;    // length of the rel path of the directory holding the file
+    ignore_rule_t *rules; size_t n_rules;
+    uint64_t stamp;     // identifies this file's version and those of its parents
+} ignore_set_t;
+
+static bool ig_bracket(const char **pp, char c) {
+    const char *p = *pp + 1;
+    if (*p == '!' || *p == '^') p++;
+    if (*p == ']') p++;
+    while (*p && *p != ']') p++;
+    if (!*p) return c == '[';                 // unterminated: literal '['
+    char expr[256]; size_t n = (size_t)(p - *pp) + 1;
+    if (n >= sizeof(expr)) return false;
+    memcpy(expr, *pp, n); expr[n] = '\0';
+    if (expr[1] == '^') expr[1] = '!';
+    char s[2] = { c, '\0' };
+    *pp = p;
+    return fnmatch(expr, s, 0) == 0;
 }
-static void unique_path(char *out, size_t outsz, const char *dest_dir, const char *name) {
-    char base[PATH_MAX], ext[PATH_MAX];
-    split_name(name, base, sizeof(base), ext, sizeof(ext));
-    snprintf(out, outsz, "%s/%s", dest_dir, name);
-    int n=1;
-    while (access(out, F_OK) == 0) {
-        if (snprintf(out, outsz, "%s/%s_%d%s", dest_dir, base, n, ext) >= (int)outsz)
-            die("Path too long (unique_path)");
-        n++;
+// Glob matcher with gitignore's '**' rules; '*' and '?' never match '/'.
+static bool ig_glob(const char *p, const char *s) {
+    while (*p) {
+        if (p[0] == '*' && p[1] == '*') {
+            p += 2;
+            if (!*p) return true;
+            if (*p == '/') {
+                p++;
+                for (;;) {
+                    if (ig_glob(p, s)) return true;
+                    const char *sl = strchr(s, '/');
+                    if (!sl) return false;
+                    s = sl + 1;
+                }
+            }
+            for (;; s++) { if (ig_glob(p, s)) return true; if (!*s) return false; }
+        }
+        if (*p == '*') {
+            p++;
+            for (;; s++) { if (ig_glob(p, s)) return true; if (!*s || *s == '/') return false; }
+        }
+        if (!*s) return false;
+        if (*p == '?') { if (*s == '/') return false; }
+        else if (*p == '[') { if (*s == '/' || !ig_bracket(&p, *s)) return false; }
+        else if (*p == '\\' && p[1]) { p++; if (*p != *s) return false; }
+        else if (*p != *s) return false;
+        p++; s++;
     }
+    return *s == '\0';
 }
 
-// ------------------------------ Job queue ------------------------------
-typedef struct job { char *src_path; char *rel_path; int depth; bool is_symlink; } job_t;
-typedef struct node { job_t job; struct node *next; } node_t;
-static struct {
-    node_t *head, *tail;
-    pthread_mutex_t mx;
-    pthread_cond_t cv;
-    bool done;
-} q = { .head=NULL, .tail=NULL, .mx=PTHREAD_MUTEX_INITIALIZER, .cv=PTHREAD_COND_INITIALIZER, .done=false };
-
-static void push_job(job_t *j) {
-    node_t *n = (node_t *)malloc(sizeof(node_t)); if (!n) die("OOM");
-    n->job = *j; n->next = NULL;
-    pthread_mutex_lock(&q.mx);
-    if (q.tail) q.tail->next = n; else q.head = n;
-    q.tail = n;
-    pthread_cond_signal(&q.cv);
-    pthread_mutex_unlock(&q.mx);
-}
-static bool pop_job(job_t *out) {
-    pthread_mutex_lock(&q.mx);
-    for (;;) {
-        if (q.head) {
-            node_t *n = q.head; q.head = n->next; if (!q.head) q.tail = NULL;
-            *out = n->job; free(n);
-            pthread_mutex_unlock(&q.mx);
-            return true;
+static bool ig_rule_matches(const ignore_rule_t *r, const char *sub, const char *name, bool is_dir) {
+    if (r->dir_only && !is_dir) return false;
+    const char *subject = r->anchored ? sub : name;
+    switch (r->kind) {
+        case IG_LITERAL: return strcmp(subject, r->pat) == 0;
+        case IG_SUFFIX: {
+            size_t n = strlen(subject);
+            return n >= r->len && memcmp(subject + n - r->len, r->pat, r->len) == 0;
         }
-        if (q.done) { pthread_mutex_unlock(&q.mx); return false; }
-        pthread_cond_wait(&q.cv, &q.mx);
+        default: return ig_glob(r->pat, subject);
     }
 }
-static void finish_jobs(void) {
-    pthread_mutex_lock(&q.mx); q.done = true; pthread_cond_broadcast(&q.cv); pthread_mutex_unlock(&q.mx);
-}
 
-// ------------------------------ Stats ------------------------------
-static struct {
-    pthread_mutex_t mx;
-    unsigned long moved, skipped, failed;
-    unsigned long long bytes_copied;
-} stats = { .mx = PTHREAD_MUTEX_INITIALIZER };
+// Returns true if 'rel' (relative to SOURCE_DIR) is excluded by the stacked sets.
+static bool ignore_check(const ignore_set_t *set, const char *rel, bool is_dir) {
+    const char *name = basename_const(rel);
+    for (; set; set = set->parent) {
+        const char *sub = rel + set->base_len;
+        if (set->base_len) sub++;
+        for (size_t i = set->n_rules; i-- > 0;) {
+            const ignore_rule_t *r = &set->rules[i];
+            if (ig_rule_matches(r, sub, name, is_dir)) return !r->negate;
+        }
+    }
+    return false;
+}
 
-static void add_moved(void) { pthread_mutex_lock(&stats.mx); stats.moved++; pthread_mutex_unlock(&stats.mx); }
-static void add_skipped(void) { pthread_mutex_lock(&stats.mx); stats.skipped++; pthread_mutex_unlock(&stats.mx); }
-static void add_failed(void) { pthread_mutex_lock(&stats.mx); stats.failed++; pthread_mutex_unlock(&stats.mx); }
-static void add_bytes(unsigned long long b) { pthread_mutex_lock(&stats.mx); stats.bytes_copied += b; pthread_mutex_unlock(&stats.mx); }
+static void ignore_add_line(ignore_set_t *set, size_t *cap, char *line) {
+    size_t len = strlen(line);
+    while (len && (line[len-1]=='\n' || line[len-1]=='\r')) line[--len] = '\0';
+    while (len && line[len-1]==' ' && !(len > 1 && line[len-2]=='\\')) line[--len] = '\0';
+    if (!len || line[0] == '#') return;
 
-// ------------------------------ Move/Copy ------------------------------
-static int copy_file_rw(const char *src, const char *dst, mode_t mode, bool preserve_times, bool progress) {
-    int in = open(src, O_RDONLY);
-    if (in < 0) return -1;
-    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode & 0777);
-    if (out < 0) { close(in); return -1; }
+    ignore_rule_t r; memset(&r, 0, sizeof(r));
+    char *p = line;
+    if (*p == '!') { r.negate = true; p++; }
+    else if (*p == '\\' && (p[1] == '#' || p[1] == '!')) p++;
+    len = strlen(p);
+    if (len && p[len-1] == '/') { r.dir_only = true; p[--len] = '\0'; }
+    if (!len) return;
+    if (strchr(p, '/')) r.anchored = true;
+    if (*p == '/') { p++; len--; }
+    if (!len) return;
 
-    char buf[1<<20]; // 1 MiB
-    ssize_t r; unsigned long long total = 0; off_t size = 0;
-    struct stat st; if (fstat(in, &st)==0) size = st.st_size; else size = 0;
+    if (!strpbrk(p, "*?[\\")) r.kind = IG_LITERAL;
+    else if (!r.anchored && p[0] == '*' && p[1] != '*' && !strpbrk(p + 1, "*?[\\/")) { r.kind = IG_SUFFIX; p++; len--; }
+    else r.kind = IG_GLOB;
+    r.pat = xstrdup(p); r.len = len;
 
-    while ((r = read(in, buf, sizeof(buf))) > 0) {
-        ssize_t w = 0;
-        while (w < r) {
-            ssize_t k = write(out, buf + w, (size_t)(r - w));
-            if (k < 0) { if (errno == EINTR) continue; close(in); close(out); return -1; }
-            w += k;
-        }
-        total += (unsigned long long)r;
-        add_bytes((unsigned long long)r);
-        if (progress && size > 0) {
-            pthread_mutex_lock(&log_mx);
-            fprintf(stdout, "  copied %llu/%lld bytes (%.0f%%)\r",
-                    total, (long long)size, (100.0*total)/((double)size));
-            fflush(stdout);
-            pthread_mutex_unlock(&log_mx);
-        }
+    if (set->n_rules == *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        set->rules = (ignore_rule_t *)realloc(set->rules, *cap * sizeof(ignore_rule_t));
+        if (!set->rules) die("OOM");
     }
-    if (progress) { pthread_mutex_lock(&log_mx); fprintf(stdout, "\n"); fflush(stdout); pthread_mutex_unlock(&log_mx); }
-    if (r < 0) { close(in); close(out); return -1; }
+    set->rules[set->n_rules++] = r;
+}
 
-#ifdef __linux__
-    if (preserve_times) {
-        struct timespec ts[2];
-        ts[0].tv_sec = st.st_atime; ts[0].tv_nsec = 0;
-        ts[1].tv_sec = st.st_mtime; ts[1].tv_nsec = 0;
-        futimens(out, ts);
+// Compiles '<dir>/.mnfignore' into 'set'. Returns false if there is no file or no rules.
+static bool ignore_load(ignore_set_t *set, const ignore_set_t *parent, const char *dir, const char *relbase) {
+    char path[PATH_MAX];
+    if (!path_join(path, sizeof(path), dir, IGNORE_FILE_NAME)) return false;
+    sys_add(SC_OPEN);
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    sys_add(SC_READ);
+    memset(set, 0, sizeof(*set));
+    set->parent = parent;
+    set->base_len = strlen(relbase);
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0) {
+        uint64_t v[4] = { parent ? parent->stamp : 0, st.st_ino, (uint64_t)st.st_size,
+                          (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec };
+        set->stamp = (((v[0] * 31 + v[1]) * 0x9E3779B97F4A7C15ULL) ^ (v[2] * 0xC2B2AE3D27D4EB4FULL + v[3])) | 1;
     }
-#endif
-    fsync(out);
-    close(in); close(out);
-    return 0;
+    size_t cap = 0; char *line = NULL; size_t linecap = 0;
+    while (getline(&line, &linecap, f) > 0) ignore_add_line(set, &cap, line);
+    free(line);
+    fclose(f);
+    return set->n_rules > 0;
 }
-static int move_symlink(const char *src, const char *dst, bool overwrite) {
-    char target[PATH_MAX]; ssize_t len = readlink(src, target, sizeof(target)-1);
-    if (len < 0) return -1; target[len] = '\0';
-    if (overwrite) unlink(dst);
-    if (symlink(target, dst) != 0) return -1;
-    if (unlink(src) != 0) return -1;
-    return 0;
+static void ignore_free(ignore_set_t *set) {
+    for (size_t i=0;i<set->n_rules;i++) free(set->rules[i].pat);
+    free(set->rules);
 }
-static int move_file_with_modes(const char *src, const char *dst, bool overwrite, bool preserve_times, bool progress) {
-    if (overwrite) unlink(dst);
-    if (rename(src, dst) == 0) return 0;
-    if (errno != EXDEV) return -1;
-    struct stat st;
-    if (stat(src, &st) < 0) return -1;
-    if (copy_file_rw(src, dst, st.st_mode, preserve_times, progress) < 0) return -1;
-    if (unlink(src) < 0) return -1;
-    return 0;
+
+// ------------------------------ Content hashing ------------------------------
+// Content digests are XXH3-128 from the bundled xxHash (src/xxhash.h, BSD
+// 2-Clause), which uses the SSE2, AVX2 or NEON code path the compiler targets.
+// A digest only nominates a duplicate: files are compared byte by byte before
+// one of them is removed (see same_bytes()). Journal and state checksums are
+// XXH64.
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+typedef struct { uint64_t lo, hi; } digest_t;
+typedef XXH3_state_t hasher_t;
+
+static void hasher_init(hasher_t *h) { XXH3_128bits_reset(h); }
+static void hasher_update(hasher_t *h, const void *data, size_t len) { XXH3_128bits_update(h, data, len); }
+static digest_t hasher_final(const hasher_t *h) {
+    XXH128_hash_t r = XXH3_128bits_digest(h);
+    digest_t d = { r.low64, r.high64 };
+    return d;
 }
+static bool digest_eq(digest_t a, digest_t b) { return a.lo == b.lo && a.hi == b.hi; }
 
-// ------------------------------ Traversal ------------------------------
-static char SRC_CANON[PATH_MAX];
-static char DST_CANON[PATH_MAX];
+// Short-string hash for table lookups.
+static uint64_t hash_str(const char *s) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (; *s; s++) { h ^= (unsigned char)*s; h *= 1099511628211ULL; }
+    return h;
+}
 
-static bool is_under(const char *path, const char *prefix) {
+// Full-content digest of an open file, read from offset 0.
+static bool digest_fd(int fd, digest_t *out) {
+    unsigned char buf[1<<20]; // 1 MiB
+    hasher_t h; hasher_init(&h);
+    off_t off = 0; ssize_t r;
+    while (sys_add(SC_READ), (r = pread(fd, buf, sizeof(buf), off)) != 0) {
+        if (r < 0) { if (errno == EINTR) continue; return false; }
+        hasher_update(&h, buf, (size_t)r); off += r;
+    }
+    *out = hasher_final(&h);
+    return true;
+}
+// Digest of three 4 KiB samples (head, middle, tail) plus the size: a cheap
+// pre-check that rejects most same-size non-duplicates without a full read.
+#define SAMPLE_BLOCK 4096
+static bool digest_sample_fd(int fd, off_t size, digest_t *out) {
+    unsigned char buf[SAMPLE_BLOCK];
+    const off_t offs[3] = { 0, size / 2 - SAMPLE_BLOCK / 2, size - SAMPLE_BLOCK };
+    hasher_t h; hasher_init(&h);
+    uint64_t sz = (uint64_t)size; hasher_update(&h, &sz, sizeof(sz));
+    for (int i=0;i<3;i++) {
+        sys_add(SC_READ);
+        ssize_t r = pread(fd, buf, sizeof(buf), offs[i] < 0 ? 0 : offs[i]);
+        if (r < 0) return false;
+        hasher_update(&h, buf, (size_t)r);
+    }
+    *out = hasher_final(&h);
+    return true;
+}
+
+// True if two open files of 'size' bytes have the same content, read from offset 0.
+#define COMPARE_BLOCK (64 * 1024)
+static bool same_bytes(int fa, int fb, off_t size) {
+    unsigned char a[COMPARE_BLOCK], b[COMPARE_BLOCK];
+    for (off_t off = 0; off < size; ) {
+        size_t want = size - off < COMPARE_BLOCK ? (size_t)(size - off) : COMPARE_BLOCK;
+        sys_add(SC_READ);
+        ssize_t ra = pread(fa, a, want, off);
+        if (ra < 0 && errno == EINTR) continue;
+        sys_add(SC_READ);
+        ssize_t rb = ra > 0 ? pread(fb, b, (size_t)ra, off) : -1;
+        if (ra <= 0 || rb != ra || memcmp(a, b, (size_t)ra) != 0) return false;
+        off += ra;
+    }
+    return true;
+}
+
+// SHA-256 (FIPS 180-4) names files in --layout=cas, where an address collision
+// would drop a different file unseen, so the address has to be collision resistant.
+typedef struct { uint32_t h[8]; uint64_t len; unsigned char buf[64]; size_t n; } sha256_t;
+#define SHA256_LEN 32
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2,
+};
+
+static inline uint32_t ror32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static void sha256_block(sha256_t *s, const unsigned char *p) {
+    uint32_t w[64], a[8];
+    for (int i=0;i<16;i++)
+        w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+    for (int i=16;i<64;i++) {
+        uint32_t s0 = ror32(w[i-15], 7) ^ ror32(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ror32(w[i-2], 17) ^ ror32(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    memcpy(a, s->h, sizeof(a));
+    for (int i=0;i<64;i++) {
+        uint32_t t1 = a[7] + (ror32(a[4], 6) ^ ror32(a[4], 11) ^ ror32(a[4], 25)) +
+                      ((a[4] & a[5]) ^ (~a[4] & a[6])) + sha256_k[i] + w[i];
+        uint32_t t2 = (ror32(a[0], 2) ^ ror32(a[0], 13) ^ ror32(a[0], 22)) +
+                      ((a[0] & a[1]) ^ (a[0] & a[2]) ^ (a[1] & a[2]));
+        memmove(a + 1, a, 7 * sizeof(a[0]));
+        a[4] += t1; a[0] = t1 + t2;
+    }
+    for (int i=0;i<8;i++) s->h[i] += a[i];
+}
+
+static void sha256_init(sha256_t *s) {
+    static const uint32_t iv[8] = { 0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,
+                                    0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19 };
+    memcpy(s->h, iv, sizeof(iv)); s->len = 0; s->n = 0;
+}
+
+static void sha256_update(sha256_t *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    s->len += len;
+    if (s->n) {
+        size_t k = 64 - s->n < len ? 64 - s->n : len;
+        memcpy(s->buf + s->n, p, k); s->n += k; p += k; len -= k;
+        if (s->n < 64) return;
+        sha256_block(s, s->buf); s->n = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) sha256_block(s, p);
+    memcpy(s->buf, p, len); s->n = len;
+}
+
+static void sha256_final(sha256_t *s, unsigned char out[SHA256_LEN]) {
+    uint64_t bits = s->len * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padlen = (s->n < 56 ? 56 : 120) - s->n;
+    for (int i=0;i<8;i++) pad[padlen + i] = (unsigned char)(bits >> (56 - 8*i));
+    sha256_update(s, pad, padlen + 8);
+    for (int i=0;i<8;i++) {
+        out[4*i] = (unsigned char)(s->h[i] >> 24); out[4*i+1] = (unsigned char)(s->h[i] >> 16);
+        out[4*i+2] = (unsigned char)(s->h[i] >> 8); out[4*i+3] = (unsigned char)s->h[i];
+    }
+}
+
+static bool sha256_fd(int fd, unsigned char out[SHA256_LEN]) {
+    unsigned char buf[1<<20]; // 1 MiB
+    sha256_t s; sha256_init(&s);
+    off_t off = 0; ssize_t r;
+    while (sys_add(SC_READ), (r = pread(fd, buf, sizeof(buf), off)) != 0) {
+        if (r < 0) { if (errno == EINTR) continue; return false; }
+        sha256_update(&s, buf, (size_t)r); off += r;
+    }
+    sha256_final(&s, out);
+    return true;
+}
+
+// Per-directory cache of destination digests, keyed by name and validated by inode,
+// size and mtime so a replaced file is never matched against stale hashes.
+typedef struct digest_entry {
+    char *name;
+    dev_t dev; ino_t ino; off_t size; struct timespec mtime;
+    bool has_sample, has_full;
+    digest_t sample, full;
+    struct digest_entry *next;
+} digest_entry_t;
+typedef struct { digest_entry_t **buckets; size_t nb, n; } digest_cache_t;
+
+static bool digest_entry_valid(const digest_entry_t *e, const struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+static digest_entry_t *digest_cache_find(const digest_cache_t *c, const char *name) {
+    if (!c->nb) return NULL;
+    for (digest_entry_t *e = c->buckets[hash_str(name) & (c->nb - 1)]; e; e = e->next)
+        if (strcmp(e->name, name) == 0) return e;
+    return NULL;
+}
+// Returns the entry for 'name', (re)initialized for the file described by 'st'.
+static digest_entry_t *digest_cache_put(digest_cache_t *c, const char *name, const struct stat *st) {
+    digest_entry_t *e = digest_cache_find(c, name);
+    if (!e) {
+        if (c->n >= c->nb) {
+            size_t nb = c->nb ? c->nb * 2 : 64;
+            digest_entry_t **nbk = (digest_entry_t **)calloc(nb, sizeof(*nbk)); if (!nbk) die("OOM");
+            for (size_t i=0;i<c->nb;i++) {
+                for (digest_entry_t *x = c->buckets[i], *next; x; x = next) {
+                    next = x->next;
+                    size_t b = hash_str(x->name) & (nb - 1);
+                    x->next = nbk[b]; nbk[b] = x;
+                }
+            }
+            free(c->buckets); c->buckets = nbk; c->nb = nb;
+        }
+        e = (digest_entry_t *)calloc(1, sizeof(*e)); if (!e) die("OOM");
+        e->name = xstrdup(name);
+        size_t b = hash_str(name) & (c->nb - 1);
+        e->next = c->buckets[b]; c->buckets[b] = e; c->n++;
+    }
+    if (!digest_entry_valid(e, st)) {
+        e->dev = st->st_dev; e->ino = st->st_ino; e->size = st->st_size; e->mtime = st->st_mtim;
+        e->has_sample = e->has_full = false;
+    }
+    return e;
+}
+static void digest_cache_free(digest_cache_t *c) {
+    for (size_t i=0;i<c->nb;i++) {
+        for (digest_entry_t *e = c->buckets[i], *next; e; e = next) { next = e->next; free(e->name); free(e); }
+    }
+    free(c->buckets); memset(c, 0, sizeof(*c));
+}
+
+// ------------------------------ Destination layout ------------------------------
+// DEST_DIR may be split into lazily created shard subdirectories (--shard).
+// Each directory files are placed into is opened once and cached; probes,
+// renames and creates then go through *at() calls on that handle, and each
+// directory has its own name lock so placement does not serialize on DEST_DIR.
+// Canonical source roots of a run, none inside another; 'next' hands them out
+// to the traversal threads.
+typedef struct { char **canon; size_t n, next; } roots_t;
+
+// A dry run simulates each directory's namespace in memory: its entries are
+// read once on first use, and every name a would-be move takes is added, so
+// later files see the same collisions as in a real run without probing DEST_DIR.
+typedef struct { char *name; char *owner; } sim_name_t; // owner: source that took it, NULL if on disk
+typedef struct { sim_name_t *slots; size_t cap, n; bool loaded; } sim_names_t;
+
+typedef struct dest_dir {
+    char *rel;              // path below DEST_DIR, "" for DEST_DIR itself
+    int fd;                 // -1 if missing (dry run) or creation failed
+    int err;                // errno of the failed open/create
+    dev_t dev;
+    pthread_mutex_t mx;     // serializes unique-name reservation and 'digests'
+    digest_cache_t digests; // --mode=dedup: content digests of entries
+    sim_names_t sim;        // dry run: simulated entries, under mx
+    struct dests *owner;
+    struct dest_dir *next;
+} dest_dir_t;
+
+#define DEST_BUCKETS 4096
+#define DEST_STRIPES 64
+typedef struct dests {
+    char canon[PATH_MAX];   // DEST_DIR, resolved
+    bool sim;               // dry run
+    dest_dir_t *buckets[DEST_BUCKETS];
+    pthread_mutex_t stripes[DEST_STRIPES];
+    dest_dir_t root;
+} dests_t;
+
+static sim_name_t *sim_slot(const sim_names_t *s, const char *name) {
+    size_t i = (size_t)hash_str(name) & (s->cap - 1);
+    while (s->slots[i].name && strcmp(s->slots[i].name, name) != 0) i = (i + 1) & (s->cap - 1);
+    return &s->slots[i];
+}
+static void sim_add(sim_names_t *s, const char *name, const char *owner) {
+    if ((s->n + 1) * 4 > s->cap * 3) {
+        sim_names_t g = { .cap = s->cap ? s->cap * 2 : 64 };
+        g.slots = (sim_name_t *)calloc(g.cap, sizeof(sim_name_t)); if (!g.slots) die("OOM");
+        for (size_t i=0;i<s->cap;i++) if (s->slots[i].name) *sim_slot(&g, s->slots[i].name) = s->slots[i];
+        free(s->slots);
+        s->slots = g.slots; s->cap = g.cap;
+    }
+    sim_name_t *e = sim_slot(s, name);
+    if (e->name) return;
+    e->name = xstrdup(name); e->owner = owner ? xstrdup(owner) : NULL;
+    s->n++;
+}
+// Caller holds dd->mx.
+static sim_names_t *sim_load(dest_dir_t *dd) {
+    sim_names_t *s = &dd->sim;
+    if (s->loaded) return s;
+    s->loaded = true;
+    if (!s->cap) sim_add(s, ".", NULL); // never a file name; sizes the table
+    if (dd->fd < 0) return s;
+    sys_add(SC_OPENDIR);
+    int fd = openat(dd->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        logf(1, "Warning: cannot read '%s/%s' (%s)", dd->owner->canon, dd->rel, strerror(errno));
+        if (fd >= 0) close(fd);
+        return s;
+    }
+    struct dirent *ent;
+    while (sys_add(SC_READDIR), (ent = readdir(d)) != NULL)
+        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) sim_add(s, ent->d_name, NULL);
+    closedir(d);
+    return s;
+}
+// Dry run: takes 'name' for the source 'owner' unless it is taken already. Caller holds dd->mx.
+static bool dest_claim(dest_dir_t *dd, const char *name, const char *owner) {
+    sim_names_t *s = sim_load(dd);
+    if (sim_slot(s, name)->name) return false;
+    sim_add(s, name, owner);
+    return true;
+}
+static void sim_free(sim_names_t *s) {
+    for (size_t i=0;i<s->cap;i++) { free(s->slots[i].name); free(s->slots[i].owner); }
+    free(s->slots); memset(s, 0, sizeof(*s));
+}
+
+static int dest_open_dir(const dests_t *ds, const char *rel, bool create, int *err) {
+    sys_add(SC_OPEN);
+    int fd = openat(ds->root.fd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 || errno != ENOENT || !create) { *err = errno; return fd; }
+    char part[PATH_MAX]; snprintf(part, sizeof(part), "%s", rel);
+    for (char *p = part;; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p; *p = '\0';
+            sys_add(SC_MKDIR);
+            if (mkdirat(ds->root.fd, part, 0775) != 0 && errno != EEXIST) { *err = errno; return -1; }
+            *p = c;
+            if (!c) break;
+        }
+    }
+    sys_add(SC_OPEN);
+    fd = openat(ds->root.fd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    *err = errno;
+    return fd;
+}
+
+// Returns false with errno set if ds->canon cannot be opened.
+static bool dest_init(dests_t *ds) {
+    for (int i=0;i<DEST_STRIPES;i++) pthread_mutex_init(&ds->stripes[i], NULL);
+    ds->root.rel = (char *)"";
+    ds->root.owner = ds;
+    ds->root.fd = open(ds->canon, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ds->root.fd < 0) return false;
+    struct stat st; if (fstat(ds->root.fd, &st) == 0) ds->root.dev = st.st_dev;
+    pthread_mutex_init(&ds->root.mx, NULL);
+    return true;
+}
+static void dest_free(dests_t *ds) {
+    for (size_t b=0;b<DEST_BUCKETS;b++) {
+        dest_dir_t *d = ds->buckets[b];
+        while (d) {
+            dest_dir_t *next = d->next;
+            if (d->fd >= 0) close(d->fd);
+            pthread_mutex_destroy(&d->mx);
+            digest_cache_free(&d->digests);
+            sim_free(&d->sim);
+            free(d->rel); free(d);
+            d = next;
+        }
+        ds->buckets[b] = NULL;
+    }
+    digest_cache_free(&ds->root.digests);
+    sim_free(&ds->root.sim);
+    close(ds->root.fd);
+}
+
+// Returns the cached handle for DEST_DIR/rel, creating the directory on first use if 'create'.
+static dest_dir_t *dest_dir_get(dests_t *ds, const char *rel, bool create) {
+    if (!*rel) return &ds->root;
+    size_t b = (size_t)(hash_str(rel) % DEST_BUCKETS);
+    pthread_mutex_t *mx = &ds->stripes[b % DEST_STRIPES];
+    mx_lock(mx, LOCK_DEST_TABLE);
+    dest_dir_t *d;
+    for (d = ds->buckets[b]; d; d = d->next)
+        if (strcmp(d->rel, rel) == 0) break;
+    if (!d) {
+        d = (dest_dir_t *)calloc(1, sizeof(*d)); if (!d) die("OOM");
+        d->rel = xstrdup(rel);
+        d->owner = ds;
+        d->fd = dest_open_dir(ds, rel, create, &d->err);
+        struct stat st; if (d->fd >= 0 && (sys_add(SC_STAT), fstat(d->fd, &st) == 0)) d->dev = st.st_dev;
+        pthread_mutex_init(&d->mx, NULL);
+        d->next = ds->buckets[b]; ds->buckets[b] = d;
+    }
+    pthread_mutex_unlock(mx);
+    return d;
+}
+
+// Returns false with errno ENAMETOOLONG if the path does not fit.
+static bool dest_path(char *out, size_t outsz, const dest_dir_t *dd, const char *name) {
+    int n = *dd->rel ? snprintf(out, outsz, "%s/%s/%s", dd->owner->canon, dd->rel, name)
+                     : snprintf(out, outsz, "%s/%s", dd->owner->canon, name);
+    if (n < (int)outsz) return true;
+    errno = ENAMETOOLONG;
+    return false;
+}
+// In a dry run the caller holds dd->mx.
+static bool dest_exists(dest_dir_t *dd, const char *name) {
+    if (dd->owner->sim) return sim_slot(sim_load(dd), name)->name != NULL;
+    if (dd->fd < 0) return false;
+    sys_add(SC_ACCESS);
+    return faccessat(dd->fd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+// Computes the shard subdirectory (relative to DEST_DIR) for a file; "" without --shard.
+static void shard_rel(shard_kind_t kind, unsigned buckets, const char *datefmt,
+                      const char *name, time_t mtime, char *out, size_t outsz) {
+    out[0] = '\0';
+    switch (kind) {
+        case SHARD_HASH: {
+            size_t width = 2;
+            for (unsigned v = (buckets - 1) >> 8; v; v >>= 4) width++;
+            if (width >= outsz) break;
+            uint64_t v = hash_str(name) % buckets;
+            out[width] = '\0';
+            while (width--) { out[width] = "0123456789abcdef"[v & 15]; v >>= 4; }
+            break;
+        }
+        case SHARD_DATE: {
+            struct tm tmv;
+            if (!localtime_r(&mtime, &tmv) || strftime(out, outsz, datefmt, &tmv) == 0)
+                snprintf(out, outsz, "_nodate");
+            break;
+        }
+        case SHARD_EXT: {
+            const char *ext = ext_of(name);
+            if (!ext || !*ext) { snprintf(out, outsz, "_noext"); break; }
+            size_t i = 0;
+            for (; ext[i] && i + 1 < outsz; i++)
+                out[i] = (ext[i]>='A'&&ext[i]<='Z') ? (char)(ext[i]-'A'+'a') : ext[i];
+            out[i] = '\0';
+            break;
+        }
+        default: break;
+    }
+}
+
+// ------------------------------ Unique naming ------------------------------
+static void split_name(const char *name, char *base, size_t bsz, char *ext, size_t extsz) {
+    const char *dot = strrchr(name, '.');
+    if (name[0]=='.' && (!dot || dot==name)) {
+        snprintf(base, bsz, "%s", name); ext[0] = '\0';
+    } else if (dot && dot != name) {
+        size_t blen = (size_t)(dot - name);
+        snprintf(base, bsz, "%.*s", (int)blen, name);
+        snprintf(ext, extsz, "%s", dot);
+    } else {
+        snprintf(base, bsz, "%s", name); ext[0] = '\0';
+    }
+}
+// Picks the first free 'name', 'base_1.ext', 'base_2.ext', ... in dd. Caller holds dd->mx.
+// Returns false with errno ENAMETOOLONG if the numbered name does not fit.
+static bool unique_name(char *out, size_t outsz, dest_dir_t *dd, const char *name) {
+    char base[PATH_MAX], ext[PATH_MAX];
+    split_name(name, base, sizeof(base), ext, sizeof(ext));
+    snprintf(out, outsz, "%s", name);
+    int n=1;
+    while (dest_exists(dd, out)) {
+        if (snprintf(out, outsz, "%s_%d%s", base, n, ext) >= (int)outsz) { errno = ENAMETOOLONG; return false; }
+        n++;
+    }
+    return true;
+}
+
+// ------------------------------ Empty-directory pruning ------------------------------
+// --prune-empty-dirs: each traversed directory counts what is still in flight
+// below it (queued files, unfinished subdirectories, and itself while being
+// read). Whoever drops the count to zero removes the directory and releases its
+// parent, so directories disappear bottom-up as the run goes, without a second
+// walk. Anything left behind (filtered, skipped, failed) marks the directory
+// and its ancestors as kept.
+typedef struct src_dir {
+    char *path;
+    struct src_dir *parent;
+    unsigned long pending;
+    bool keep;
+} src_dir_t;
+
+static src_dir_t *src_dir_open(const char *path, src_dir_t *parent) {
+    src_dir_t *d = (src_dir_t *)calloc(1, sizeof(*d)); if (!d) die("OOM");
+    d->path = xstrdup(path);
+    d->parent = parent;
+    d->pending = 1;
+    if (parent) __atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+    return d;
+}
+static void src_dir_hold(src_dir_t *d) {
+    if (d) __atomic_add_fetch(&d->pending, 1, __ATOMIC_RELAXED);
+}
+static void src_dir_keep(src_dir_t *d) {
+    if (d) __atomic_store_n(&d->keep, true, __ATOMIC_RELAXED);
+}
+// Drops one pending reference; 'gone' tells whether the entry left the directory.
+static void src_dir_release(src_dir_t *d, bool gone) {
+    if (d && !gone) src_dir_keep(d);
+    while (d && __atomic_sub_fetch(&d->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        src_dir_t *parent = d->parent;
+        if (parent) {
+            if (__atomic_load_n(&d->keep, __ATOMIC_RELAXED)) { src_dir_keep(parent); goto next; }
+            uint64_t t = now_ns();
+            sys_add_in(PHASE_PRUNE, SC_RMDIR);
+            if (rmdir(d->path) == 0) logf(2, "Removed empty directory: %s", d->path);
+            else src_dir_keep(parent);
+            add_phase(PHASE_PRUNE, now_ns() - t);
+        }
+    next:
+        free(d->path); free(d);
+        d = parent;
+    }
+}
+
+// ------------------------------ Job queue ------------------------------
+// Jobs read from a --plan-in or --undo file are 'mapped': their paths point
+// into the mapping. A --plan-in job is 'planned': rel_path is the target below
+// DEST_DIR that the plan chose. An --undo job moves src_path back to rel_path,
+// or copies it there if 'keep_src'. 'sd' is the directory's --state entry.
+// 'io' are the devices whose concurrency limit the job counts against while it
+// runs (-1: none).
+struct state_dir;
+typedef struct job {
+    char *src_path; char *rel_path; int depth;
+    bool is_symlink, mapped, planned, keep_src;
+    time_t mtime; off_t size; dev_t dev; src_dir_t *dir;
+    struct state_dir *sd;
+    int io[2];
+} job_t;
+typedef struct node { job_t job; struct node *next; } node_t;
+
+// Jobs are queued per source device, and every device (source or destination)
+// may limit how many jobs touching it run at once (--device-limit; none by
+// default). A worker takes the oldest job of the next device in
+// round-robin order whose job can start, so a saturated disk holds back only
+// its own jobs. Devices without a limit cost no extra locking. Device 0 stands
+// for jobs whose source device is not known (--plan-in, --undo).
+typedef struct {
+    dev_t dev;
+    int limit, active;          // limit 0: unlimited
+    node_t *head, *tail;        // jobs whose source is on this device
+    unsigned long jobs;
+} device_t;
+
+typedef struct {
+    device_t *devs; size_t n_devs, cap_devs;
+    size_t next_dev;            // where the next pick starts
+    pthread_mutex_t mx;
+    pthread_cond_t cv;
+    bool done;
+    unsigned long depth;        // written under mx, read racily by the progress reporter
+    unsigned long pending;      // jobs pushed and not yet finished
+    unsigned long queued;       // jobs pushed in all
+    int sleeping;               // workers waiting for a job, their output flushed
+    pthread_cond_t idle;        // signalled when a worker goes to sleep with nothing pending
+} queue_t;
+
+// --device-limit: limits for the devices of given paths, for rotational disks
+// and for all other devices.
+typedef struct {
+    struct { dev_t dev; int limit; } *paths; size_t n;
+    int hdd, other;
+} io_limits_t;
+#define IO_LIMITS_DEFAULT { NULL, 0, 0, 0 }
+
+// A handle (mnf_t): everything one run reads and writes, and the worker pool
+// that serves its runs. mnf_open() makes one for libmnf and main() one for the
+// command line; handles share nothing but the stats slots and the log sinks.
+// The run files are defined with their sections and allocated by handle_new().
+struct journal; struct undo; struct state; struct plan;
+struct mnf {
+    options_t opt;
+    io_limits_t limits;
+    queue_t q;
+    dests_t dests;
+    bool dest_ready;            // 'dests' is set up; kept while runs go into the same DEST_DIR
+    roots_t roots;
+    bool cancel;                // mnf_cancel(): queue nothing more, skip what is queued; cleared as a run ends
+    bool traversed;             // the current run has queued all its jobs
+    pthread_mutex_t run_mx;     // one run at a time
+    int nth, started;
+    pthread_t *ths;
+    stats_slot_t **slots;       // the workers' stats slots, for a run's counts
+    unsigned long planned, recorded; // what the last run wrote to --plan-out and --state
+    struct journal *jr;         // --journal
+    struct undo *undo;          // --undo-log, --undo
+    struct state *state;        // --state
+    struct plan *plan;          // --plan-out, --plan-in
+    mnf_event_cb cb; void *user;
+};
+
+// Releases a finished job; 'gone' tells whether its source left SOURCE_DIR.
+static void job_finish(job_t *j, bool gone) {
+    src_dir_release(j->dir, gone);
+    if (j->mapped) return;
+    free(j->src_path); free(j->rel_path);
+}
+
+// Parses the --device-limit entries into 'l': hdd=N, other=N or PATH=N (0: unlimited).
+static void io_limits_parse(const options_t *o, io_limits_t *l) {
+    for (size_t i=0;i<o->n_device_limits;i++) {
+        const char *spec = o->device_limits[i], *eq = strrchr(spec, '=');
+        char *end = NULL;
+        long n = eq ? strtol(eq + 1, &end, 10) : -1;
+        if (!eq || eq == spec || end == eq + 1 || *end || n < 0 || n > 1000000) die("Invalid --device-limit: %s", spec);
+        char key[PATH_MAX]; snprintf(key, sizeof(key), "%.*s", (int)(eq - spec), spec);
+        if (strcmp(key, "hdd") == 0) { l->hdd = (int)n; continue; }
+        if (strcmp(key, "other") == 0) { l->other = (int)n; continue; }
+        struct stat st;
+        if (stat(key, &st) != 0) die("Invalid --device-limit: cannot stat '%s' (%s)", key, strerror(errno));
+        l->paths = (__typeof__(l->paths))realloc(l->paths, (l->n + 1) * sizeof(*l->paths));
+        if (!l->paths) die("OOM");
+        l->paths[l->n].dev = st.st_dev; l->paths[l->n].limit = (int)n;
+        l->n++;
+    }
+}
+
+// Whether the block device behind 'dev' is rotational; false if unknown.
+static bool dev_rotational(dev_t dev) {
+    static const char *const paths[] = { "/sys/dev/block/%u:%u/queue/rotational",
+                                         "/sys/dev/block/%u:%u/../queue/rotational" }; // partition
+    for (int i=0;i<2;i++) {
+        char p[96]; snprintf(p, sizeof(p), paths[i], major(dev), minor(dev));
+        int fd = open(p, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        char c = '0';
+        ssize_t n = read(fd, &c, 1);
+        close(fd);
+        return n == 1 && c == '1';
+    }
+    return false;
+}
+
+// The limit for 'dev'; reads sysfs, so it is called without q->mx held.
+static int device_limit(const io_limits_t *l, dev_t dev) {
+    for (size_t i=0;i<l->n;i++) if (l->paths[i].dev == dev) return l->paths[i].limit;
+    return l->hdd != l->other && dev && dev_rotational(dev) ? l->hdd : l->other;
+}
+static int device_find(const queue_t *q, dev_t dev) {
+    for (size_t i=0;i<q->n_devs;i++) if (q->devs[i].dev == dev) return (int)i;
+    return -1;
+}
+// Index of the entry for 'dev', created on first use; under q->mx, which is
+// dropped while the limit of a new device is looked up.
+static int device_get(mnf_t *m, dev_t dev) {
+    queue_t *q = &m->q;
+    int i = device_find(q, dev);
+    if (i >= 0) return i;
+    pthread_mutex_unlock(&q->mx);
+    int limit = device_limit(&m->limits, dev);
+    mx_lock(&q->mx, LOCK_QUEUE);
+    if ((i = device_find(q, dev)) >= 0) return i; // added meanwhile
+    if (q->n_devs == q->cap_devs) {
+        q->cap_devs = q->cap_devs ? q->cap_devs * 2 : 8;
+        q->devs = (device_t *)realloc(q->devs, q->cap_devs * sizeof(device_t)); if (!q->devs) die("OOM");
+    }
+    device_t *d = &q->devs[q->n_devs];
+    memset(d, 0, sizeof(*d));
+    d->dev = dev;
+    d->limit = limit;
+    return (int)q->n_devs++;
+}
+static bool device_free(const queue_t *q, int i) {
+    return !q->devs[i].limit || q->devs[i].active < q->devs[i].limit;
+}
+
+static void push_job(mnf_t *m, job_t *j) {
+    queue_t *q = &m->q;
+    node_t *n = (node_t *)malloc(sizeof(node_t)); if (!n) die("OOM");
+    n->job = *j; n->next = NULL;
+    n->job.io[0] = n->job.io[1] = -1;
+    mx_lock(&q->mx, LOCK_QUEUE);
+    device_get(m, m->dests.root.dev); // for queue_pick()
+    int i = device_get(m, j->dev); // may move q->devs
+    device_t *d = &q->devs[i];
+    if (d->tail) d->tail->next = n; else d->head = n;
+    d->tail = n;
+    __atomic_store_n(&q->depth, q->depth + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->queued, q->queued + 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&q->pending, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&q->cv);
+    pthread_mutex_unlock(&q->mx);
+}
+// Takes the next job that may start now, or returns NULL; under q->mx.
+static node_t *queue_pick(mnf_t *m) {
+    queue_t *q = &m->q;
+    int dst = device_find(q, m->dests.root.dev); // added by push_job()
+    for (size_t k=0;k<q->n_devs;k++) {
+        size_t i = (q->next_dev + k) % q->n_devs;
+        device_t *d = &q->devs[i];
+        bool other = dst >= 0 && (int)i != dst;
+        if (!d->head || !device_free(q, (int)i) || (other && !device_free(q, dst))) continue;
+        node_t *n = d->head; d->head = n->next; if (!d->head) d->tail = NULL;
+        q->next_dev = i + 1;
+        d->jobs++;
+        if (d->limit) { d->active++; n->job.io[0] = (int)i; }
+        if (other && q->devs[dst].limit) { q->devs[dst].active++; n->job.io[1] = dst; }
+        return n;
+    }
+    return NULL;
+}
+static bool pop_job(mnf_t *m, job_t *out) {
+    queue_t *q = &m->q;
+    mx_lock(&q->mx, LOCK_QUEUE);
+    for (bool flushed = false;;) {
+        node_t *n = q->depth ? queue_pick(m) : NULL;
+        if (n) {
+            __atomic_store_n(&q->depth, q->depth - 1, __ATOMIC_RELAXED);
+            *out = n->job; free(n);
+            pthread_mutex_unlock(&q->mx);
+            return true;
+        }
+        if (q->done && !q->depth) { pthread_mutex_unlock(&q->mx); return false; }
+        if (!flushed) {
+            // Going idle: hand buffered output to the writer before sleeping.
+            pthread_mutex_unlock(&q->mx);
+            sink_flush_thread(false);
+            mx_lock(&q->mx, LOCK_QUEUE);
+            flushed = true;
+            continue;
+        }
+        uint64_t t = now_ns();
+        q->sleeping++;
+        if (!__atomic_load_n(&q->pending, __ATOMIC_ACQUIRE)) pthread_cond_broadcast(&q->idle);
+        pthread_cond_wait(&q->cv, &q->mx);
+        q->sleeping--;
+        uint64_t t1 = now_ns();
+        STAT_ADD(idle_waits, 1);
+        STAT_ADD(idle_ns, t1 - t);
+        trace_span("queue wait", t, t1, NULL);
+        flushed = false;
+    }
+}
+// Gives back the job's device slots and wakes the workers waiting for one.
+static void job_release_io(mnf_t *m, const job_t *j) {
+    if (j->io[0] < 0 && j->io[1] < 0) return;
+    queue_t *q = &m->q;
+    mx_lock(&q->mx, LOCK_QUEUE);
+    for (int k=0;k<2;k++) if (j->io[k] >= 0) q->devs[j->io[k]].active--;
+    pthread_cond_broadcast(&q->cv);
+    pthread_mutex_unlock(&q->mx);
+}
+#ifndef MNF_LIBRARY
+static void print_device_stats(const mnf_t *m) {
+    const queue_t *q = &m->q;
+    bool limited = false;
+    for (size_t i=0;i<q->n_devs;i++) limited = limited || q->devs[i].limit;
+    if (q->n_devs < 2 && !limited) return;
+    for (size_t i=0;i<q->n_devs;i++) {
+        const device_t *d = &q->devs[i];
+        char limit[32] = "unlimited";
+        if (d->limit) snprintf(limit, sizeof(limit), "limit %d", d->limit);
+        logf(2, "Device %u:%u: %lu jobs from it, %s", major(d->dev), minor(d->dev), d->jobs, limit);
+    }
+}
+#endif
+static void queue_free(mnf_t *m) {
+    free(m->q.devs);
+    m->q.devs = NULL; m->q.n_devs = m->q.cap_devs = m->q.next_dev = 0;
+    free(m->limits.paths);
+    m->limits.paths = NULL; m->limits.n = 0;
+}
+static void finish_jobs(mnf_t *m) {
+    queue_t *q = &m->q;
+    mx_lock(&q->mx, LOCK_QUEUE); q->done = true; pthread_cond_broadcast(&q->cv); pthread_mutex_unlock(&q->mx);
+}
+
+typedef enum { JOB_MOVED=0, JOB_DEDUPED, JOB_SKIPPED, JOB_WOULD_MOVE, JOB_WOULD_DROP, JOB_FAILED } job_result_t;
+
+// What happened to a job, filled by process_job() for reporting.
+typedef struct {
+    char target[PATH_MAX];
+    move_method_t method;
+    bool renamed;   // placed under a different name to avoid a collision
+    int err;        // errno of a failed job
+} job_out_t;
+
+// ------------------------------ Progress reporter ------------------------------
+// --progress: a dedicated thread samples the sharded counters at a fixed rate
+// and prints one aggregate status line to stderr, so workers never block on
+// terminal output. Rates are smoothed; the ETA uses the traversal totals and
+// is only shown once traversal has finished.
+#define PROGRESS_INTERVAL_MS 500
+
+#ifndef MNF_LIBRARY
+static struct {
+    pthread_t th;
+    pthread_mutex_t mx;
+    pthread_cond_t cv;
+    const mnf_t *m;
+    bool stop;
+    bool tty;
+} progress = { .mx = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER };
+
+static void format_bytes(char *out, size_t outsz, double b) {
+    const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+    int u = 0;
+    while (b >= 1024.0 && u < 5) { b /= 1024.0; u++; }
+    snprintf(out, outsz, u ? "%.1f %s" : "%.0f %s", b, units[u]);
+}
+
+static void progress_print(const stats_slot_t *st, double files_rate, double bytes_rate, bool final) {
+    unsigned long done = st->moved + st->skipped + st->failed + st->deduped;
+    char rate[32], left[32], eta[32] = "-";
+    format_bytes(rate, sizeof(rate), bytes_rate);
+    double bytes_left = st->bytes_queued > st->bytes_done ? (double)(st->bytes_queued - st->bytes_done) : 0.0;
+    format_bytes(left, sizeof(left), bytes_left);
+    if (__atomic_load_n(&progress.m->traversed, __ATOMIC_ACQUIRE)) {
+        double secs = -1;
+        if (bytes_rate > 0 && bytes_left > 0) secs = bytes_left / bytes_rate;
+        else if (files_rate > 0) secs = (double)(st->queued - done) / files_rate;
+        if (secs >= 0) {
+            unsigned long s = (unsigned long)(secs + 0.5);
+            snprintf(eta, sizeof(eta), "%lu:%02lu:%02lu", s / 3600, (s / 60) % 60, s % 60);
+        }
+    } else {
+        snprintf(eta, sizeof(eta), "scanning");
+    }
+    fprintf(stderr, "%s%lu/%lu files | %.0f files/s | %s/s | queue %lu | %s left | ETA %s%s",
+            progress.tty ? "\r\033[K" : "", done, st->queued, files_rate, rate,
+            __atomic_load_n(&progress.m->q.depth, __ATOMIC_RELAXED), left, eta,
+            (progress.tty && !final) ? "" : "\n");
+    fflush(stderr);
+}
+
+static void *progress_main(void *arg) {
+    (void)arg;
+    stats_slot_t prev, cur; stats_snapshot(&prev);
+    uint64_t t_prev = now_ns(), t_print = 0;
+    double files_rate = 0, bytes_rate = 0;
+    bool stop = false;
+    while (!stop) {
+        pthread_mutex_lock(&progress.mx);
+        struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+        dl.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+        if (dl.tv_nsec >= 1000000000L) { dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+        if (!progress.stop) pthread_cond_timedwait(&progress.cv, &progress.mx, &dl);
+        stop = progress.stop;
+        pthread_mutex_unlock(&progress.mx);
+
+        stats_snapshot(&cur);
+        uint64_t t = now_ns();
+        double dt = (double)(t - t_prev) / 1e9;
+        if (dt > 0) {
+            unsigned long dfiles = (cur.moved + cur.skipped + cur.failed + cur.deduped) -
+                                   (prev.moved + prev.skipped + prev.failed + prev.deduped);
+            double fr = (double)dfiles / dt, br = (double)(cur.bytes_done - prev.bytes_done) / dt;
+            // exponential smoothing, seeded with the first sample
+            files_rate = files_rate ? 0.7 * files_rate + 0.3 * fr : fr;
+            bytes_rate = bytes_rate ? 0.7 * bytes_rate + 0.3 * br : br;
+        }
+        prev = cur; t_prev = t;
+        // Without a terminal, emit a plain line every few seconds instead of redrawing.
+        if (progress.tty || stop || t - t_print >= 5000000000ULL) {
+            progress_print(&cur, files_rate, bytes_rate, stop);
+            t_print = t;
+        }
+    }
+    return NULL;
+}
+
+static void progress_start(const mnf_t *m) {
+    progress.m = m;
+    progress.tty = isatty(STDERR_FILENO);
+    if (pthread_create(&progress.th, NULL, progress_main, NULL) != 0) die("pthread_create failed");
+}
+static void progress_stop(void) {
+    pthread_mutex_lock(&progress.mx);
+    progress.stop = true;
+    pthread_cond_signal(&progress.cv);
+    pthread_mutex_unlock(&progress.mx);
+    pthread_join(progress.th, NULL);
+}
+#endif
+
+// ------------------------------ Metrics ------------------------------
+// --metrics-file / --metrics-socket: a dedicated thread renders the sharded
+// counters (relaxed loads; workers never stop) in the Prometheus text format.
+// It rewrites the textfile atomically every interval for the node_exporter
+// textfile collector, and in between answers scrapes on a unix socket with a
+// minimal HTTP/1.0 response.
+#define METRICS_BUF (64 * 1024)
+
+#ifndef MNF_LIBRARY
+static struct {
+    pthread_t th;
+    const char *file, *sock_path;
+    int sock;
+    uint64_t interval_ns;
+    const mnf_t *m;
+    bool stop;
+} metrics = { .sock = -1 };
+
+static size_t metrics_render(char *buf, size_t sz) {
+    stats_slot_t st; stats_snapshot(&st);
+    size_t n = 0;
+#define OUT(...) do { if (n < sz) n += (size_t)snprintf(buf + n, sz - n, __VA_ARGS__); } while (0)
+#define FAMILY(name, type, help) OUT("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type)
+    FAMILY("mnf_files_total", "counter", "Files finished, by result.");
+    OUT("mnf_files_total{result=\"moved\"} %lu\nmnf_files_total{result=\"skipped\"} %lu\n"
+        "mnf_files_total{result=\"failed\"} %lu\nmnf_files_total{result=\"deduped\"} %lu\n",
+        st.moved, st.skipped, st.failed, st.deduped);
+    FAMILY("mnf_moves_total", "counter", "Moved files, by method.");
+    OUT("mnf_moves_total{method=\"rename\"} %lu\nmnf_moves_total{method=\"copy\"} %lu\n"
+        "mnf_moves_total{method=\"clone\"} %lu\nmnf_moves_total{method=\"symlink\"} %lu\n",
+        st.renames, st.copies, st.clones, st.symlinks);
+    FAMILY("mnf_bytes_total", "counter", "Bytes moved, by method.");
+    OUT("mnf_bytes_total{method=\"rename\"} %llu\nmnf_bytes_total{method=\"copy\"} %llu\n",
+        st.bytes_renamed, st.bytes_copied);
+    FAMILY("mnf_errors_total", "counter", "Files that could not be moved.");
+    OUT("mnf_errors_total %lu\n", st.failed);
+    FAMILY("mnf_queued_files_total", "counter", "Files handed to workers by the traversal.");
+    OUT("mnf_queued_files_total %lu\n", st.queued);
+    FAMILY("mnf_queued_bytes_total", "counter", "Size of the files handed to workers.");
+    OUT("mnf_queued_bytes_total %llu\n", st.bytes_queued);
+    FAMILY("mnf_queue_depth", "gauge", "Jobs waiting in the queue.");
+    OUT("mnf_queue_depth %lu\n", __atomic_load_n(&metrics.m->q.depth, __ATOMIC_RELAXED));
+    FAMILY("mnf_workers", "gauge", "Worker threads.");
+    OUT("mnf_workers %d\n", metrics.m->nth);
+    FAMILY("mnf_workers_active", "gauge", "Worker threads processing a job.");
+    OUT("mnf_workers_active %lu\n", st.busy);
+    FAMILY("mnf_phase_seconds_total", "counter", "Thread time, by phase.");
+    for (int p=0;p<PHASE_COUNT;p++) OUT("mnf_phase_seconds_total{phase=\"%s\"} %.6f\n", phase_names[p], st.phase_ns[p] / 1e9);
+    FAMILY("mnf_log_dropped_total", "counter", "Log records dropped under --log-policy=drop.");
+    OUT("mnf_log_dropped_total %lu\n", __atomic_load_n(&log_sink.dropped, __ATOMIC_RELAXED));
+    FAMILY("mnf_op_latency_seconds", "summary", "Latency of single operations.");
+    for (int op=0;op<OP_COUNT;op++) {
+        op_summary_t ls; op_summary((op_t)op, &ls);
+        OUT("mnf_op_latency_seconds{op=\"%s\",quantile=\"0.5\"} %.9f\n"
+            "mnf_op_latency_seconds{op=\"%s\",quantile=\"0.99\"} %.9f\n"
+            "mnf_op_latency_seconds{op=\"%s\",quantile=\"0.999\"} %.9f\n"
+            "mnf_op_latency_seconds_sum{op=\"%s\"} %.9f\n"
+            "mnf_op_latency_seconds_count{op=\"%s\"} %lu\n",
+            op_names[op], ls.p50 / 1e9, op_names[op], ls.p99 / 1e9, op_names[op], ls.p999 / 1e9,
+            op_names[op], ls.sum / 1e9, op_names[op], ls.count);
+    }
+    OUT("# EOF\n");
+#undef FAMILY
+#undef OUT
+    return n < sz ? n : sz - 1;
+}
+
+// Writes FILE.tmp and renames it over FILE, so collectors never see a partial file.
+static void metrics_write_file(char *buf) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", metrics.file) >= (int)sizeof(tmp)) return;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) { logf(1, "Warning: cannot write metrics file '%s' (%s)", tmp, strerror(errno)); return; }
+    bool ok = write_full(fd, buf, metrics_render(buf, METRICS_BUF));
+    if (close(fd) != 0) ok = false;
+    if (!ok || rename(tmp, metrics.file) != 0) {
+        logf(1, "Warning: cannot write metrics file '%s' (%s)", metrics.file, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+// One scrape: read whatever request arrives (waiting at most a second), answer, close.
+static void metrics_serve(int c, char *buf) {
+    struct timeval tv = { 1, 0 };
+    setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    struct pollfd p = { c, POLLIN, 0 };
+    char req[4096];
+    if (poll(&p, 1, 1000) > 0 && read(c, req, sizeof(req)) < 0) { close(c); return; }
+    size_t len = metrics_render(buf, METRICS_BUF);
+    char hdr[128];
+    int h = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n\r\n", len);
+    if (write_full(c, hdr, (size_t)h)) write_full(c, buf, len);
+    shutdown(c, SHUT_WR);
+    close(c);
+}
+
+static void *metrics_main(void *arg) {
+    (void)arg;
+    tls_verbose = metrics.m->opt.verbose;
+    char *buf = (char *)malloc(METRICS_BUF); if (!buf) die("OOM");
+    uint64_t next = now_ns();
+    while (!__atomic_load_n(&metrics.stop, __ATOMIC_ACQUIRE)) {
+        uint64_t now = now_ns();
+        if (metrics.file && now >= next) { metrics_write_file(buf); next = now + metrics.interval_ns; now = now_ns(); }
+        // Wake at least every 200 ms to notice shutdown.
+        uint64_t wait_ms = (metrics.file && next > now) ? (next - now) / 1000000 : 200;
+        if (wait_ms > 200) wait_ms = 200;
+        if (metrics.sock < 0) { struct timespec ts = { 0, (long)wait_ms * 1000000L }; nanosleep(&ts, NULL); continue; }
+        struct pollfd p = { metrics.sock, POLLIN, 0 };
+        if (poll(&p, 1, (int)wait_ms) <= 0) continue;
+        int c = accept4(metrics.sock, NULL, NULL, SOCK_CLOEXEC);
+        if (c >= 0) metrics_serve(c, buf);
+    }
+    if (metrics.file) metrics_write_file(buf); // final counts
+    free(buf);
+    return NULL;
+}
+
+static void metrics_start(const mnf_t *m) {
+    const options_t *o = &m->opt;
+    metrics.file = o->metrics_file;
+    metrics.sock_path = o->metrics_socket;
+    metrics.interval_ns = o->metrics_interval_ns;
+    metrics.m = m;
+    if (metrics.sock_path) {
+        struct sockaddr_un sa; memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(metrics.sock_path) >= sizeof(sa.sun_path)) die("Metrics socket path too long: %s", metrics.sock_path);
+        strcpy(sa.sun_path, metrics.sock_path);
+        struct stat st; // replace a stale socket, never anything else
+        if (lstat(metrics.sock_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(metrics.sock_path);
+        metrics.sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (metrics.sock < 0 || bind(metrics.sock, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(metrics.sock, 16) != 0)
+            die("Cannot listen on metrics socket %s (%s)", metrics.sock_path, strerror(errno));
+    }
+    if (pthread_create(&metrics.th, NULL, metrics_main, NULL) != 0) die("pthread_create failed");
+}
+// Called once the run is over, so the file ends with the final counts.
+static void metrics_stop(void) {
+    __atomic_store_n(&metrics.stop, true, __ATOMIC_RELEASE);
+    pthread_join(metrics.th, NULL);
+    if (metrics.sock >= 0) { close(metrics.sock); unlink(metrics.sock_path); }
+}
+#endif
+
+// ------------------------------ Events ------------------------------
+// --events=json:TARGET writes one JSON object per line: a record for every
+// finished job and a summary at the end. Job records go through their own
+// asynchronous sink, so workers only format into a thread-local buffer.
+static sink_t events_sink = { .fd = -1 };
+static const char *const method_names[] = { "none", "rename", "copy", "symlink", "clone" };
+
+#ifndef MNF_LIBRARY
+// Opens TARGET: a path (truncated), '-' for stdout or fd:N for an inherited descriptor.
+static int events_open(const char *target) {
+    if (strcmp(target, "-") == 0) return STDOUT_FILENO;
+    if (strncmp(target, "fd:", 3) == 0) {
+        char *end = NULL; errno = 0;
+        long fd = strtol(target + 3, &end, 10);
+        if (errno || end == target + 3 || *end || fd < 0 || fd > INT_MAX || fcntl((int)fd, F_GETFD) < 0)
+            die("Invalid --events descriptor: %s", target);
+        return (int)fd;
+    }
+    int fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) die("Cannot open event file: %s (%s)", target, strerror(errno));
+    return fd;
+}
+#endif
+
+static void event_job(const job_t *j, job_result_t r, const job_out_t *out, uint64_t latency_ns) {
+    static const char *const names[] = { "moved", "deduped", "skipped", "would_move", "would_drop", "failed" };
+    char src[PATH_MAX * 6], dst[PATH_MAX * 6], err[256] = "";
+    const char *ev = (r == JOB_MOVED && out->renamed) ? "renamed" : names[r];
+    json_escape(j->src_path, src, sizeof(src));
+    json_escape(out->target, dst, sizeof(dst));
+    if (r == JOB_FAILED) snprintf(err, sizeof(err), ",\"error\":\"%s\"", strerror(out->err));
+    struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
+    sink_printf(&events_sink,
+                "{\"ts\":%lld.%03ld,\"event\":\"%s\",\"src\":\"%s\",\"dst\":\"%s\",\"bytes\":%lld,"
+                "\"method\":\"%s\",\"latency_us\":%llu%s}",
+                (long long)ts.tv_sec, ts.tv_nsec / 1000000, ev, src, dst, (long long)j->size,
+                method_names[out->method], (unsigned long long)(latency_ns / 1000), err);
+}
+
+// libmnf: the mnf_set_callback() callback, called on the worker threads.
+_Static_assert(MNF_MOVED == (int)JOB_MOVED && MNF_SKIPPED == (int)JOB_SKIPPED && MNF_FAILED == (int)JOB_FAILED,
+               "mnf_result_t must follow job_result_t");
+
+static void event_callback(const mnf_t *m, const job_t *j, job_result_t r, const job_out_t *out) {
+    mnf_event_t ev = { (mnf_result_t)r, j->src_path, out->target, (int64_t)j->size, out->err };
+    m->cb(&ev, m->user);
+}
+
+#ifndef MNF_LIBRARY
+// Written synchronously once the sinks have been stopped.
+static void event_summary(const stats_slot_t *st, uint64_t elapsed_ns) {
+    if (events_sink.fd < 0 || events_sink.broken) return;
+    char buf[16384]; size_t n = 0;
+#define OUT(...) do { if (n < sizeof(buf)) n += (size_t)snprintf(buf + n, sizeof(buf) - n, __VA_ARGS__); } while (0)
+    OUT("{\"event\":\"summary\",\"moved\":%lu,\"skipped\":%lu,\"failed\":%lu,\"deduped\":%lu,"
+        "\"renames\":%lu,\"copies\":%lu,\"clones\":%lu,\"symlinks\":%lu,"
+        "\"bytes_copied\":%llu,\"bytes_renamed\":%llu,\"elapsed_ms\":%llu,",
+        st->moved, st->skipped, st->failed, st->deduped,
+        st->renames, st->copies, st->clones, st->symlinks,
+        st->bytes_copied, st->bytes_renamed, (unsigned long long)(elapsed_ns / 1000000));
+    OUT("\"thread_ms\":{");
+    for (int p=0;p<PHASE_COUNT;p++) OUT("%s\"%s\":%llu", p ? "," : "", phase_names[p], st->phase_ns[p] / 1000000);
+    unsigned long total = 0;
+    OUT("},\"syscalls\":{");
+    for (int p=0;p<PHASE_COUNT;p++) {
+        OUT("%s\"%s\":{", p ? "," : "", phase_names[p]);
+        for (int k=0;k<SC_COUNT;k++) { OUT("%s\"%s\":%lu", k ? "," : "", sys_names[k], st->sys[p][k]); total += st->sys[p][k]; }
+        OUT("}");
+    }
+    OUT("},\"syscalls_per_file\":%.2f,", st->moved ? (double)total / (double)st->moved : 0.0);
+    OUT("\"locks\":{");
+    for (int l=0;l<LOCK_COUNT;l++)
+        OUT("%s\"%s\":{\"acquired\":%lu,\"contended\":%lu,\"wait_ms\":%.1f}",
+            l ? "," : "", lock_names[l], st->lock_acq[l], st->lock_contended[l], st->lock_wait_ns[l] / 1e6);
+    OUT("},\"queue_idle_ms\":%llu,\"log_full_waits\":%lu,\"log_dropped\":%lu,\"events_dropped\":%lu",
+        st->idle_ns / 1000000, log_sink.full_waits, log_sink.dropped, events_sink.dropped);
+    if (g_op_hist) {
+        OUT(",\"latency_us\":{");
+        for (int op=0;op<OP_COUNT;op++) {
+            op_summary_t ls; op_summary((op_t)op, &ls);
+            OUT("%s\"%s\":{\"count\":%lu,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+                op ? "," : "", op_names[op], ls.count, ls.p50 / 1e3, ls.p99 / 1e3, ls.p999 / 1e3, ls.max / 1e3);
+        }
+        OUT("}");
+    }
+    OUT("}\n");
+#undef OUT
+    dprintf(events_sink.fd, "%s", buf);
+}
+#endif
+
+// ------------------------------ Group commit ------------------------------
+// An append-only log whose records must be on file before the step they
+// describe is taken (the journal and the undo log). Appenders copy a record
+// into the buffer under 'mx' and get a ticket; a writer thread writes
+// whatever has accumulated and commits it with one fdatasync(), so concurrent
+// workers share commits, and synclog_wait() blocks until a ticket is durable.
+// synclog_flush() only waits until a ticket is written, which outlives the
+// process but not the machine: an appender writes the buffer itself then,
+// while the writer's fdatasync() goes on without holding 'mx'.
+typedef struct {
+    int fd;
+    const char *what;                // for error messages
+    lock_class_t lock;
+    pthread_t th;
+    pthread_mutex_t mx;
+    pthread_cond_t cv, durable_cv;
+    char *buf; size_t len, cap;      // appended, not yet written
+    unsigned long appended, written, durable; // record counts
+    unsigned long commits;
+    bool stop;
+} synclog_t;
+#define SYNCLOG_INIT(name, cls) { .fd = -1, .what = name, .lock = cls, .mx = PTHREAD_MUTEX_INITIALIZER, \
+                                  .cv = PTHREAD_COND_INITIALIZER, .durable_cv = PTHREAD_COND_INITIALIZER }
+
+// Locks the log and returns room for 'need' bytes; synclog_publish() unlocks.
+static char *synclog_reserve(synclog_t *l, size_t need) {
+    mx_lock(&l->mx, l->lock);
+    if (l->len + need > l->cap) {
+        while (l->len + need > l->cap) l->cap = l->cap ? l->cap * 2 : 64 * 1024;
+        l->buf = (char *)realloc(l->buf, l->cap); if (!l->buf) die("OOM");
+    }
+    return l->buf + l->len;
+}
+// Appends the 'len' bytes written since synclog_reserve(); returns the ticket for synclog_wait().
+static unsigned long synclog_publish(synclog_t *l, size_t len) {
+    l->len += len;
+    unsigned long ticket = ++l->appended;
+    pthread_cond_signal(&l->cv);
+    pthread_mutex_unlock(&l->mx);
+    return ticket;
+}
+
+static void synclog_wait(synclog_t *l, unsigned long ticket) {
+    if (!ticket) return;
+    mx_lock(&l->mx, l->lock);
+    while (l->durable < ticket) pthread_cond_wait(&l->durable_cv, &l->mx);
+    pthread_mutex_unlock(&l->mx);
+}
+
+// Writes out the buffer; called with 'mx' held, so records reach the file in ticket order.
+static void synclog_write(synclog_t *l) {
+    if (!l->len) return;
+    sys_add(SC_WRITE);
+    if (!write_full(l->fd, l->buf, l->len)) die("%s write failed (%s)", l->what, strerror(errno));
+    l->len = 0;
+    l->written = l->appended;
+    pthread_cond_signal(&l->cv);
+}
+static void synclog_flush(synclog_t *l, unsigned long ticket) {
+    if (!ticket) return;
+    mx_lock(&l->mx, l->lock);
+    if (l->written < ticket) synclog_write(l);
+    pthread_mutex_unlock(&l->mx);
+}
+
+static void *synclog_main(void *arg) {
+    synclog_t *l = (synclog_t *)arg;
+    mx_lock(&l->mx, l->lock);
+    for (;;) {
+        while (!l->len && l->durable == l->written && !l->stop) pthread_cond_wait(&l->cv, &l->mx);
+        if (!l->len && l->durable == l->written) break;
+        synclog_write(l);
+        unsigned long ticket = l->written;
+        pthread_mutex_unlock(&l->mx);
+        sys_add(SC_FSYNC);
+        if (fdatasync(l->fd) != 0) die("%s sync failed (%s)", l->what, strerror(errno));
+        mx_lock(&l->mx, l->lock);
+        l->durable = ticket; l->commits++;
+        pthread_cond_broadcast(&l->durable_cv);
+    }
+    pthread_mutex_unlock(&l->mx);
+    return NULL;
+}
+
+static void synclog_start(synclog_t *l, int fd) {
+    l->fd = fd; l->stop = false;
+    if (pthread_create(&l->th, NULL, synclog_main, l) != 0) die("pthread_create failed");
+}
+// Commits what is left and closes the log; call once no job appends any more.
+static void synclog_stop(synclog_t *l) {
+    if (l->fd < 0) return;
+    mx_lock(&l->mx, l->lock);
+    l->stop = true;
+    pthread_cond_signal(&l->cv);
+    pthread_mutex_unlock(&l->mx);
+    pthread_join(l->th, NULL);
+    close(l->fd); l->fd = -1;
+    logf(2, "%s: %lu records in %lu commits", l->what, l->appended, l->commits);
+    free(l->buf);
+    l->buf = NULL; l->len = l->cap = 0;
+    l->appended = l->written = l->durable = l->commits = 0;
+}
+
+// ------------------------------ Journal ------------------------------
+// --journal FILE: cross-device copies are written to a temporary name next to
+// the target and renamed into place once complete. A BEGIN record (source,
+// temporary, target) is appended before the copy starts and must be durable
+// before the temporary file is renamed into place, so its commit overlaps the
+// copy; DONE or ABORT follows without waiting. Records are group-committed
+// (see synclog_t). Same-device renames are atomic and are not journaled.
+// --resume replays the open BEGIN records of a killed run before starting.
+// Records: u32 length, u32 type, u64 seq, NUL-terminated strings, and the
+// XXH64 of everything before it; a torn tail fails the check and ends the log.
+#define JOURNAL_MAGIC "MNFJRNL"
+#define JOURNAL_VERSION 1u
+typedef enum { J_BEGIN=1, J_DONE=2, J_ABORT=3 } journal_type_t;
+
+typedef struct { uint32_t len, type; uint64_t seq; } journal_rec_t;
+
+typedef struct journal {
+    synclog_t log;
+    uint64_t seq;                    // BEGIN records appended
+} journal_t;
+#define JOURNAL_INIT { .log = SYNCLOG_INIT("Journal", LOCK_JOURNAL) }
+
+static uint64_t journal_sum(const void *p, size_t len) { return XXH64(p, len, 0); }
+
+// Appends one record; returns its ticket for journal_wait(). A BEGIN record gets
+// the next seq, so they are numbered in log order. Strings are NULL-terminated varargs.
+static unsigned long journal_append(journal_t *jr, journal_type_t type, uint64_t *seq, ...) {
+    size_t need = sizeof(journal_rec_t) + sizeof(uint64_t);
+    va_list ap; va_start(ap, seq);
+    for (const char *s; (s = va_arg(ap, const char *)); ) need += strlen(s) + 1;
+    va_end(ap);
+    char *p = synclog_reserve(&jr->log, need);
+    if (type == J_BEGIN) *seq = ++jr->seq;
+    journal_rec_t r = { (uint32_t)need, (uint32_t)type, *seq };
+    memcpy(p, &r, sizeof(r));
+    size_t off = sizeof(r);
+    va_start(ap, seq);
+    for (const char *s; (s = va_arg(ap, const char *)); ) { size_t l = strlen(s) + 1; memcpy(p + off, s, l); off += l; }
+    va_end(ap);
+    uint64_t sum = journal_sum(p, off);
+    memcpy(p + off, &sum, sizeof(sum));
+    return synclog_publish(&jr->log, need);
+}
+
+static void journal_wait(journal_t *jr, unsigned long ticket) { synclog_wait(&jr->log, ticket); }
+
+// Records the intent to copy 'src' via 'tmp' to 'target' without waiting;
+// 'ticket' is for journal_wait() before the rename into place. Returns the id
+// for journal_end(), 0 without --journal.
+static uint64_t journal_begin(journal_t *jr, const char *src, const char *tmp, const char *target, unsigned long *ticket) {
+    *ticket = 0;
+    if (jr->log.fd < 0) return 0;
+    uint64_t seq;
+    *ticket = journal_append(jr, J_BEGIN, &seq, src, tmp, target, (const char *)NULL);
+    return seq;
+}
+static void journal_end(journal_t *jr, uint64_t seq, bool done) {
+    if (seq) journal_append(jr, done ? J_DONE : J_ABORT, &seq, (const char *)NULL);
+}
+
+// True if both files exist with identical content.
+static bool same_content(const char *a, const char *b) {
+    int fa = open(a, O_RDONLY | O_CLOEXEC), fb = open(b, O_RDONLY | O_CLOEXEC);
+    struct stat sa, sb;
+    bool same = fa >= 0 && fb >= 0 && fstat(fa, &sa) == 0 && fstat(fb, &sb) == 0 &&
+                S_ISREG(sa.st_mode) && S_ISREG(sb.st_mode) && sa.st_size == sb.st_size &&
+                same_bytes(fa, fb, sa.st_size);
+    if (fa >= 0) close(fa);
+    if (fb >= 0) close(fb);
+    return same;
+}
+
+// Brings an interrupted copy to a consistent state: a leftover temporary is
+// removed (the source is moved again), and a source whose copy already landed
+// under its target is removed. Returns false if nothing was left to do.
+static bool journal_recover_one(const char *src, const char *tmp, const char *target) {
+    struct stat st;
+    if (lstat(tmp, &st) == 0) {
+        if (unlink(tmp) != 0) die("Resume: cannot remove '%s' (%s)", tmp, strerror(errno));
+        logf(1, "Resume: removed partial copy of '%s'", src);
+        return true;
+    }
+    if (lstat(src, &st) != 0) return false;
+    if (!*target || !same_content(src, target)) return false; // the rerun moves it
+    if (unlink(src) != 0) die("Resume: cannot remove '%s' (%s)", src, strerror(errno));
+    logf(1, "Resume: finished '%s' -> '%s'", src, target);
+    return true;
+}
+
+// Reads an existing journal. With 'resume' its open copies are recovered;
+// without, open copies are an error so an interrupted run is not overlooked.
+static void journal_replay(const char *path, bool resume) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { if (errno == ENOENT) return; die("Cannot open journal '%s' (%s)", path, strerror(errno)); }
+    struct stat st;
+    if (fstat(fd, &st) != 0) die("Cannot stat journal '%s' (%s)", path, strerror(errno));
+    if (st.st_size == 0) { close(fd); return; }
+    size_t len = (size_t)st.st_size;
+    char *map = (char *)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) die("Cannot map journal '%s' (%s)", path, strerror(errno));
+    if (len < 16 || memcmp(map, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) die("Not a journal: %s", path);
+
+    // BEGIN records by seq (1-based, dense); closed ones are cleared.
+    const char **begins = NULL; size_t nb = 0;
+    size_t off = 16;
+    while (off + sizeof(journal_rec_t) + sizeof(uint64_t) <= len) {
+        journal_rec_t r; memcpy(&r, map + off, sizeof(r));
+        if (r.len < sizeof(r) + sizeof(uint64_t) || r.len > len - off) break;
+        uint64_t sum; memcpy(&sum, map + off + r.len - sizeof(sum), sizeof(sum));
+        if (sum != journal_sum(map + off, r.len - sizeof(sum))) break;
+        const char *s = map + off + sizeof(r), *end = map + off + r.len - sizeof(sum);
+        if (r.type == J_BEGIN && r.seq == nb + 1) {
+            const char *t = memchr(s, '\0', (size_t)(end - s));
+            const char *g = t ? memchr(t + 1, '\0', (size_t)(end - t - 1)) : NULL;
+            if (!g || !memchr(g + 1, '\0', (size_t)(end - g - 1))) break;
+            begins = (const char **)realloc(begins, ++nb * sizeof(char *)); if (!begins) die("OOM");
+            begins[nb - 1] = s;
+        } else if ((r.type == J_DONE || r.type == J_ABORT) && r.seq >= 1 && r.seq <= nb) {
+            begins[r.seq - 1] = NULL;
+        } else break;
+        off += r.len;
+    }
+    if (off != len) logf(1, "Journal: ignoring %zu bytes of incomplete records at the end of '%s'", len - off, path);
+
+    unsigned long open_n = 0, fixed = 0;
+    for (size_t i=0;i<nb;i++) {
+        if (!begins[i]) continue;
+        open_n++;
+        if (!resume) continue;
+        const char *tmp = begins[i] + strlen(begins[i]) + 1;
+        if (journal_recover_one(begins[i], tmp, tmp + strlen(tmp) + 1)) fixed++;
+    }
+    free(begins);
+    munmap(map, len);
+    if (open_n && !resume) die("Journal '%s' has %lu unfinished copies; rerun with --resume", path, open_n);
+    if (resume) logf(1, "Resume: %lu unfinished copies in journal, %lu needed recovery", open_n, fixed);
+}
+
+// Starts a fresh journal; an existing one is replayed first (see journal_replay).
+static void journal_open(journal_t *jr, const char *path, bool resume) {
+    journal_replay(path, resume);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) die("Cannot create journal '%s' (%s)", path, strerror(errno));
+    char hdr[16] = JOURNAL_MAGIC;
+    uint32_t v = JOURNAL_VERSION; memcpy(hdr + 8, &v, sizeof(v));
+    if (!write_full(fd, hdr, sizeof(hdr)) || fdatasync(fd) != 0)
+        die("Cannot write journal '%s' (%s)", path, strerror(errno));
+    jr->seq = 0;
+    synclog_start(&jr->log, fd);
+}
+// Called once the run's jobs are finished; commits the last DONE records.
+static void journal_close(journal_t *jr) { synclog_stop(&jr->log); }
+
+// ------------------------------ Move/Copy ------------------------------
+// If 'h' is given, the copied bytes are also fed into it. Otherwise the data is
+// reflinked where the filesystem allows it (e.g. across btrfs subvolumes or bind
+// mounts, which rename() refuses with EXDEV); returns 1 then, 0 after a copy.
+// Copies go to a fresh temporary name that is renamed into place when complete.
+static void tmp_name(char *out, size_t outsz) {
+    static unsigned long tmp_seq;
+    snprintf(out, outsz, ".mnf-tmp-%ld-%lu", (long)getpid(), __atomic_fetch_add(&tmp_seq, 1, __ATOMIC_RELAXED));
+}
+
+static int copy_file_rw(const char *src, int dirfd, const char *name, mode_t mode, bool preserve_times, sha256_t *h) {
+    uint64_t t = op_begin();
+    sys_add(SC_OPEN);
+    int in = open(src, O_RDONLY);
+    if (in < 0) { op_end(OP_COPY, t); return -1; }
+    sys_add(SC_OPEN);
+    int out = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL, mode & 0777);
+    if (out < 0) { int e = errno; close(in); op_end(OP_COPY, t); errno = e; return -1; }
+
+    char buf[1<<20]; // 1 MiB
+    ssize_t r = 0;
+    sys_add(SC_STAT);
+    struct stat st; if (fstat(in, &st)!=0) memset(&st, 0, sizeof(st));
+
+    bool cloned = false;
+#ifdef FICLONE
+    if (!h && (sys_add(SC_OTHER), ioctl(out, FICLONE, in) == 0)) cloned = true;
+#endif
+    while (!cloned && (sys_add(SC_READ), (r = read(in, buf, sizeof(buf))) > 0)) {
+        ssize_t w = 0;
+        while (w < r) {
+            sys_add(SC_WRITE);
+            ssize_t k = write(out, buf + w, (size_t)(r - w));
+            if (k < 0) { if (errno == EINTR) continue; goto fail; }
+            w += k;
+        }
+        if (h) sha256_update(h, buf, (size_t)r);
+        add_bytes((unsigned long long)r);
+    }
+    if (!cloned && r < 0) goto fail;
+
+#ifdef __linux__
+    if (preserve_times) {
+        struct timespec ts[2];
+        ts[0].tv_sec = st.st_atime; ts[0].tv_nsec = 0;
+        ts[1].tv_sec = st.st_mtime; ts[1].tv_nsec = 0;
+        sys_add(SC_OTHER);
+        futimens(out, ts);
+    }
+#endif
+    op_end(OP_COPY, t);
+    // A copy whose data may not have reached the disk is a failed copy: the
+    // caller removes the temporary file and keeps the source.
+    t = op_begin();
+    sys_add(SC_FSYNC);
+    int rc = fsync(out);
+    op_end(OP_FSYNC, t);
+    int e = errno;
+    close(in);
+    if (close(out) != 0 && rc == 0) { rc = -1; e = errno; }
+    errno = e;
+    if (rc != 0) return -1;
+    return cloned ? 1 : 0;
+fail:
+    e = errno;
+    close(in); close(out);
+    op_end(OP_COPY, t);
+    errno = e;
+    return -1;
+}
+static int unlink_src(const char *src) {
+    uint64_t t = op_begin();
+    sys_add(SC_UNLINK);
+    int rc = unlink(src);
+    op_end(OP_UNLINK, t);
+    return rc;
+}
+static int move_symlink(const char *src, int dirfd, const char *name, bool overwrite) {
+    sys_add(SC_STAT);
+    char target[PATH_MAX]; ssize_t len = readlink(src, target, sizeof(target)-1);
+    if (len < 0) return -1; target[len] = '\0';
+    if (overwrite) { sys_add(SC_UNLINK); unlinkat(dirfd, name, 0); }
+    sys_add(SC_SYMLINK);
+    if (symlinkat(target, dirfd, name) != 0) return -1;
+    if (unlink_src(src) != 0) return -1;
+    return 0;
+}
+// Like renameat(), but fails with EEXIST instead of replacing an existing target.
+static int rename_noreplace_at(int odirfd, const char *oname, int dirfd, const char *name) {
+    uint64_t t = op_begin();
+    int rc;
+#ifdef RENAME_NOREPLACE
+    sys_add(SC_RENAME);
+    rc = renameat2(odirfd, oname, dirfd, name, RENAME_NOREPLACE);
+    if (rc == 0 || (errno != EINVAL && errno != ENOSYS)) goto out;
+#endif
+    sys_add(SC_ACCESS);
+    if (faccessat(dirfd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0) { errno = EEXIST; rc = -1; goto out; }
+    sys_add(SC_RENAME);
+    rc = renameat(odirfd, oname, dirfd, name);
+out:
+    op_end(OP_RENAME, t);
+    return rc;
+}
+static int rename_noreplace(const char *src, int dirfd, const char *name) {
+    return rename_noreplace_at(AT_FDCWD, src, dirfd, name);
+}
+// Without 'overwrite' an existing target is never replaced; the caller sees EEXIST.
+// 'target' is the full path of dirfd/name, for the journal.
+static int move_file_with_modes(journal_t *jr, const char *src, int dirfd, const char *name, const char *target,
+                                bool overwrite, bool preserve_times, move_method_t *method) {
+    *method = METHOD_RENAME;
+    if (overwrite) {
+        sys_add(SC_UNLINK);
+        unlinkat(dirfd, name, 0);
+        uint64_t t = op_begin();
+        sys_add(SC_RENAME);
+        int rc = renameat(AT_FDCWD, src, dirfd, name);
+        op_end(OP_RENAME, t);
+        if (rc == 0) return 0;
+    } else if (rename_noreplace(src, dirfd, name) == 0) return 0;
+    if (errno != EXDEV) return -1;
+    struct stat st;
+    sys_add(SC_STAT);
+    if (stat(src, &st) < 0) return -1;
+    char tmp[64], tmppath[PATH_MAX];
+    tmp_name(tmp, sizeof(tmp));
+    snprintf(tmppath, sizeof(tmppath), "%.*s/%s", (int)(basename_const(target) - target - 1), target, tmp);
+    unsigned long ticket;
+    uint64_t seq = journal_begin(jr, src, tmppath, target, &ticket);
+    int rc = copy_file_rw(src, dirfd, tmp, st.st_mode, preserve_times, NULL);
+    if (rc >= 0) {
+        *method = rc ? METHOD_CLONE : METHOD_COPY;
+        journal_wait(jr, ticket);
+        if (!overwrite) rc = rename_noreplace_at(dirfd, tmp, dirfd, name);
+        else {
+            uint64_t t = op_begin();
+            sys_add(SC_RENAME);
+            rc = renameat(dirfd, tmp, dirfd, name);
+            op_end(OP_RENAME, t);
+        }
+    }
+    if (rc < 0) {
+        int e = errno; sys_add(SC_UNLINK); unlinkat(dirfd, tmp, 0); errno = e;
+        journal_end(jr, seq, false);
+        return -1;
+    }
+    if (unlink_src(src) < 0) return -1; // left open: --resume removes the source
+    journal_end(jr, seq, true);
+    return 0;
+}
+
+// ------------------------------ Dedup ------------------------------
+// --mode=dedup: before a name is taken, every occupied candidate of the
+// name, base_1.ext, ... chain is compared with the source by size, then
+// sampled digest, then full digest. Destination digests are cached per
+// directory, and a source's digests are remembered under its new name.
+#define DEDUP_SAMPLE_MIN (256 * 1024) // below this a full digest is as cheap as a sample
+
+typedef struct {
+    const char *path;
+    struct stat st;
+    int fd;
+    bool has_sample, has_full;
+    digest_t sample, full;
+} dedup_src_t;
+
+typedef enum { DEDUP_FREE=0, DEDUP_DUP=1, DEDUP_FAILED=2 } dedup_result_t;
+
+static bool dedup_src_open(dedup_src_t *src) {
+    if (src->fd < 0) { sys_add(SC_OPEN); src->fd = open(src->path, O_RDONLY | O_CLOEXEC); }
+    return src->fd >= 0;
+}
+
+// 'owner' is set for a name a dry run gave to an earlier source; its content is read from there.
+static bool dedup_same_content(dest_dir_t *dd, const char *name, const char *owner, const struct stat *dst, dedup_src_t *src) {
+    off_t size = src->st.st_size;
+    if (dst->st_size != size) return false;
+    if (dst->st_dev == src->st.st_dev && dst->st_ino == src->st.st_ino) return true;
+    if (size == 0) return true;
+
+    digest_t ds = {0, 0}, df = {0, 0}; bool have_s = false, have_f = false;
+    mx_lock(&dd->mx, LOCK_DEST_DIR);
+    digest_entry_t *e = digest_cache_find(&dd->digests, name);
+    if (e && digest_entry_valid(e, dst)) { have_s = e->has_sample; ds = e->sample; have_f = e->has_full; df = e->full; }
+    pthread_mutex_unlock(&dd->mx);
+
+    bool same = false;
+    int dfd = -1;
+    if (!have_f) {
+        sys_add(SC_OPEN);
+        dfd = owner ? open(owner, O_RDONLY | O_CLOEXEC) : openat(dd->fd, name, O_RDONLY | O_CLOEXEC);
+        if (dfd < 0) return false;
+    }
+    uint64_t t = op_begin();
+    if (!dedup_src_open(src)) goto out;
+    if (size >= DEDUP_SAMPLE_MIN && !have_f) {
+        if (!src->has_sample && !(src->has_sample = digest_sample_fd(src->fd, size, &src->sample))) goto out;
+        if (!have_s && !(have_s = digest_sample_fd(dfd, size, &ds))) goto out;
+        if (!digest_eq(ds, src->sample)) goto out;
+    }
+    if (!src->has_full && !(src->has_full = digest_fd(src->fd, &src->full))) goto out;
+    if (!have_f && !(have_f = digest_fd(dfd, &df))) goto out;
+    same = digest_eq(df, src->full);
+    if (same && dfd < 0) {
+        sys_add(SC_OPEN);
+        dfd = owner ? open(owner, O_RDONLY | O_CLOEXEC) : openat(dd->fd, name, O_RDONLY | O_CLOEXEC);
+    }
+    // Equal digests only nominate a duplicate; the bytes decide.
+    if (same) same = dfd >= 0 && same_bytes(src->fd, dfd, size);
+out:
+    op_end(OP_HASH, t);
+    if (dfd >= 0) close(dfd);
+    if (have_s || have_f) {
+        mx_lock(&dd->mx, LOCK_DEST_DIR);
+        e = digest_cache_put(&dd->digests, name, dst);
+        if (have_s) { e->sample = ds; e->has_sample = true; }
+        if (have_f) { e->full = df; e->has_full = true; }
+        pthread_mutex_unlock(&dd->mx);
+    }
+    return same;
+}
+
+// Walks the collision chain for 'name' in dd. Returns DEDUP_DUP with the identical
+// entry in 'out', DEDUP_FREE with the first unused name in 'out', or DEDUP_FAILED
+// with errno ENAMETOOLONG if the numbered name does not fit.
+static dedup_result_t dedup_place(dest_dir_t *dd, const char *name, dedup_src_t *src, char *out, size_t outsz) {
+    char base[PATH_MAX], ext[PATH_MAX];
+    split_name(name, base, sizeof(base), ext, sizeof(ext));
+    snprintf(out, outsz, "%s", name);
+    for (int n=1;;n++) {
+        struct stat dst;
+        if (dd->owner->sim) {
+            // A free name is taken at once; names are never given back.
+            mx_lock(&dd->mx, LOCK_DEST_DIR);
+            sim_name_t *e = sim_slot(sim_load(dd), out);
+            const char *owner = e->owner;
+            bool taken = e->name != NULL;
+            if (!taken) sim_add(&dd->sim, out, src->path);
+            pthread_mutex_unlock(&dd->mx);
+            if (!taken) return DEDUP_FREE;
+            sys_add(SC_STAT);
+            if ((owner ? lstat(owner, &dst) : fstatat(dd->fd, out, &dst, AT_SYMLINK_NOFOLLOW)) == 0 &&
+                S_ISREG(dst.st_mode) && dedup_same_content(dd, out, owner, &dst, src))
+                return DEDUP_DUP;
+        } else if (dd->fd < 0 || (sys_add(SC_STAT), fstatat(dd->fd, out, &dst, AT_SYMLINK_NOFOLLOW) != 0)) {
+            if (dd->fd < 0 || errno == ENOENT) return DEDUP_FREE;
+        } else if (S_ISREG(dst.st_mode) && dedup_same_content(dd, out, NULL, &dst, src)) {
+            return DEDUP_DUP;
+        }
+        if (snprintf(out, outsz, "%s_%d%s", base, n, ext) >= (int)outsz) { errno = ENAMETOOLONG; return DEDUP_FAILED; }
+    }
+}
+
+// After a same-device rename the source inode is the new entry; keep its digests.
+static void dedup_remember(dest_dir_t *dd, const char *name, const dedup_src_t *src) {
+    if (!src->has_sample && !src->has_full) return;
+    if (src->st.st_dev != dd->dev) return;
+    mx_lock(&dd->mx, LOCK_DEST_DIR);
+    digest_entry_t *e = digest_cache_put(&dd->digests, name, &src->st);
+    if (src->has_sample) { e->sample = src->sample; e->has_sample = true; }
+    if (src->has_full) { e->full = src->full; e->has_full = true; }
+    pthread_mutex_unlock(&dd->mx);
+}
+
+// ------------------------------ Content-addressed layout ------------------------------
+// --layout=cas: a file's name is the hex SHA-256 of its content plus its
+// extension, so an existing target is by construction identical and the
+// collision check is a single no-replace rename/link. Same-device sources are
+// hashed and renamed, provided size and mtime are unchanged since hashing;
+// cross-device sources are hashed while being copied into a temporary file in
+// DEST_DIR that is then renamed to its address.
+typedef enum { CAS_MOVED=0, CAS_DUP=1, CAS_FAILED=2 } cas_result_t;
+#define CAS_HASH_TRIES 3
+
+static void undo_intent(struct undo *u, char type, const char *src, const char *target, off_t size);
+static void undo_cancel(struct undo *u, const char *src, const char *target);
+static int drop_duplicate(struct undo *u, const char *src, const char *target, off_t size);
+
+static void cas_name(const unsigned char d[SHA256_LEN], const char *name, char *out, size_t outsz) {
+    const char *ext = ext_of(name);
+    char hex[2 * SHA256_LEN + 1];
+    for (int i=0;i<SHA256_LEN;i++) snprintf(hex + 2*i, 3, "%02x", d[i]);
+    snprintf(out, outsz, "%s%s%s", hex, ext ? "." : "", ext ? ext : "");
+}
+
+// True if 'b' is the same, unmodified file as 'a'.
+static bool cas_unchanged(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// NULL (errno ENAMETOOLONG) if the target path does not fit.
+static dest_dir_t *cas_dest(mnf_t *m, const char *cname, time_t mtime, char *target, size_t targetsz) {
+    const options_t *o = &m->opt;
+    char shard[PATH_MAX];
+    shard_rel(o->shard, o->shard_buckets, o->shard_datefmt, cname, mtime, shard, sizeof(shard));
+    dest_dir_t *dd = dest_dir_get(&m->dests, shard, !o->dry_run);
+    if (!dest_path(target, targetsz, dd, cname)) return NULL;
+    if (dd->fd < 0 && !o->dry_run) errno = dd->err;
+    return dd;
+}
+
+// Dry run: an address taken on disk or by an earlier file means a duplicate.
+static cas_result_t cas_claim(dest_dir_t *dd, const char *cname, const char *src) {
+    mx_lock(&dd->mx, LOCK_DEST_DIR);
+    bool fresh = dest_claim(dd, cname, src);
+    pthread_mutex_unlock(&dd->mx);
+    return fresh ? CAS_MOVED : CAS_DUP;
+}
+
+static cas_result_t cas_move(mnf_t *m, const char *src, bool is_symlink, char *target, size_t targetsz,
+                             move_method_t *method) {
+    const options_t *o = &m->opt;
+    const dest_dir_t *root = &m->dests.root;
+    const char *name = basename_const(src);
+    char cname[PATH_MAX];
+    struct stat st;
+    uint64_t t = op_begin();
+    sys_add(SC_STAT);
+    if (lstat(src, &st) != 0) return CAS_FAILED;
+    op_end(OP_LSTAT, t);
+
+    if (is_symlink) {
+        sys_add(SC_STAT);
+        char link[PATH_MAX]; ssize_t len = readlink(src, link, sizeof(link)-1);
+        if (len < 0) return CAS_FAILED;
+        link[len] = '\0';
+        unsigned char d[SHA256_LEN];
+        sha256_t h; sha256_init(&h); sha256_update(&h, link, (size_t)len); sha256_final(&h, d);
+        cas_name(d, name, cname, sizeof(cname));
+        dest_dir_t *dd = cas_dest(m, cname, st.st_mtime, target, targetsz);
+        if (!dd) return CAS_FAILED;
+        if (o->dry_run) return cas_claim(dd, cname, src);
+        if (dd->fd < 0) return CAS_FAILED;
+        *method = METHOD_SYMLINK;
+        undo_intent(m->undo, 'M', src, target, st.st_size);
+        sys_add(SC_SYMLINK);
+        bool dup = symlinkat(link, dd->fd, cname) != 0;
+        if (dup) undo_cancel(m->undo, src, target);
+        if (dup) return errno == EEXIST && drop_duplicate(m->undo, src, target, st.st_size) == 0 ? CAS_DUP : CAS_FAILED;
+        if (unlink_src(src) != 0) { undo_cancel(m->undo, src, target); return CAS_FAILED; }
+        return CAS_MOVED;
+    }
+
+    // A source written to while it is hashed would be renamed to a wrong address:
+    // hash again, and give up with EAGAIN if it keeps changing.
+    for (int attempt = 0; o->dry_run || st.st_dev == root->dev; attempt++) {
+        if (attempt == CAS_HASH_TRIES) { errno = EAGAIN; return CAS_FAILED; }
+        sys_add(SC_OPEN);
+        int fd = open(src, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return CAS_FAILED;
+        struct stat hs, now;
+        t = op_begin();
+        unsigned char d[SHA256_LEN];
+        bool ok = (sys_add(SC_STAT), fstat(fd, &hs) == 0) && sha256_fd(fd, d);
+        op_end(OP_HASH, t);
+        close(fd);
+        if (!ok) return CAS_FAILED;
+        cas_name(d, name, cname, sizeof(cname));
+        dest_dir_t *dd = cas_dest(m, cname, st.st_mtime, target, targetsz);
+        if (!dd) return CAS_FAILED;
+        if (o->dry_run) return cas_claim(dd, cname, src);
+        if (dd->fd < 0) return CAS_FAILED;
+        sys_add(SC_STAT);
+        if (lstat(src, &now) != 0) return CAS_FAILED;
+        if (!cas_unchanged(&hs, &now)) { st = now; continue; }
+        *method = METHOD_RENAME;
+        undo_intent(m->undo, 'M', src, target, st.st_size);
+        if (rename_noreplace(src, dd->fd, cname) == 0) return CAS_MOVED;
+        undo_cancel(m->undo, src, target);
+        if (errno == EEXIST) return drop_duplicate(m->undo, src, target, st.st_size) == 0 ? CAS_DUP : CAS_FAILED;
+        if (errno != EXDEV) return CAS_FAILED;
+        break;
+    }
+
+    *method = METHOD_COPY;
+    char tmp[64], tmppath[PATH_MAX];
+    tmp_name(tmp, sizeof(tmp));
+    if (!path_join(tmppath, sizeof(tmppath), m->dests.canon, tmp)) return CAS_FAILED;
+    unsigned long ticket;
+    uint64_t seq = journal_begin(m->jr, src, tmppath, "", &ticket); // the address is known only after the copy
+    sha256_t h; sha256_init(&h);
+    if (copy_file_rw(src, root->fd, tmp, st.st_mode, o->preserve_times, &h) < 0) {
+        int e = errno; sys_add(SC_UNLINK); unlinkat(root->fd, tmp, 0); errno = e;
+        journal_end(m->jr, seq, false);
+        return CAS_FAILED;
+    }
+    unsigned char d[SHA256_LEN];
+    sha256_final(&h, d);
+    cas_name(d, name, cname, sizeof(cname));
+    dest_dir_t *dd = cas_dest(m, cname, st.st_mtime, target, targetsz);
+    bool dup = false;
+    journal_wait(m->jr, ticket);
+    if (dd && dd->fd >= 0) undo_intent(m->undo, 'M', src, target, st.st_size);
+    if (!dd || dd->fd < 0 || rename_noreplace_at(root->fd, tmp, dd->fd, cname) != 0) {
+        int e = errno; sys_add(SC_UNLINK); unlinkat(root->fd, tmp, 0); errno = e;
+        if (!dd || dd->fd < 0) { journal_end(m->jr, seq, false); return CAS_FAILED; }
+        undo_cancel(m->undo, src, target);
+        if (errno != EEXIST) { journal_end(m->jr, seq, false); return CAS_FAILED; }
+        dup = true;
+    }
+    if (dup ? drop_duplicate(m->undo, src, target, st.st_size) != 0 : unlink_src(src) != 0) {
+        if (!dup) undo_cancel(m->undo, src, target);
+        return CAS_FAILED;
+    }
+    journal_end(m->jr, seq, true);
+    return dup ? CAS_DUP : CAS_MOVED;
+}
+
+// ------------------------------ Directory state ------------------------------
+// --state FILE: remembers each source directory's (dev, ino, mtime) and the
+// subdirectories it had. A directory whose mtime is unchanged is not read
+// again; only its remembered subdirectories are visited. A directory is only
+// remembered when nothing in it is left to do: no failed or skipped files, no
+// files held back by size or age filters (these change without touching the
+// directory), and no mtime so recent that a change within the same timestamp
+// tick could go unnoticed. Ignore files can change without touching their
+// directory either, so each entry keeps a stamp of the ignore files in effect.
+// Moving files out changes a directory's mtime, so once its last job has
+// finished it is stat'ed again and that mtime is kept; a file someone else
+// added while its jobs ran is then found once the directory changes again.
+// The table is rewritten at the end of each run and mapped by the next; it is
+// only used with the same SOURCE_DIR, DEST_DIR and options.
+#define STATE_MAGIC "MNFSTAT"
+#define STATE_VERSION 1
+#define STATE_RACY_NS 1000000000LL
+
+typedef struct {
+    char magic[8];
+    uint32_t version, pad;
+    uint64_t options;           // hash of what decides which entries are traversed
+    uint64_t n_slots, slots_off, names_off, names_size;
+} state_header_t;
+
+typedef struct {
+    uint64_t dev, ino;          // both 0: empty slot
+    int64_t mtime_ns;
+    uint64_t ignores;           // ignore_set_t stamp
+    uint64_t names, names_len;  // NUL-terminated subdirectory names in the names area
+} state_slot_t;
+
+// This run's view of one directory; 'pending' counts its queued jobs, and
+// the traversal while it reads the directory.
+typedef struct state_dir {
+    uint64_t dev, ino; int64_t mtime_ns; uint64_t ignores;
+    char *path;
+    char *names; size_t len, cap;
+    unsigned long pending;
+    bool racy, dirty, moved;
+    struct state_dir *next;
+} state_dir_t;
+
+typedef struct state {
+    void *map; size_t len;
+    const state_header_t *h;    // NULL without a usable previous state
+    const state_slot_t *slots;
+    const char *names;
+    uint64_t options;
+    state_dir_t *dirs;          // pushed lock-free
+    unsigned long unchanged;
+} state_t;
+
+static int64_t stat_mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+static uint64_t state_slot_hash(uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+static uint64_t state_options_hash(const mnf_t *m) {
+    const options_t *o = &m->opt;
+    const roots_t *roots = &m->roots;
+    XXH64_state_t h; XXH64_reset(&h, 0);
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "%s|%s|%d|%d|%d|%d|%d|%lld|%d|%lld|%d|%d|", roots->canon[0], m->dests.canon,
+                     o->min_depth, o->max_depth, o->include_symlinks, o->ignore_files,
+                     o->has_min_size, (long long)o->min_size, o->has_max_size, (long long)o->max_size,
+                     o->has_newer, o->has_older);
+    XXH64_update(&h, buf, (size_t)n);
+    for (size_t i=1;i<roots->n;i++) XXH64_update(&h, roots->canon[i], strlen(roots->canon[i]) + 1);
+    char **lists[] = { o->includes, o->excludes, o->allow_ext, o->deny_ext };
+    size_t counts[] = { o->n_includes, o->n_excludes, o->n_allow_ext, o->n_deny_ext };
+    for (int l=0;l<4;l++) {
+        for (size_t i=0;i<counts[l];i++) XXH64_update(&h, lists[l][i], strlen(lists[l][i]) + 1);
+        XXH64_update(&h, "|", 1);
+    }
+    return XXH64_digest(&h);
+}
+
+// Maps the previous state if there is a usable one.
+static void state_load(state_t *s, const char *path, const mnf_t *m) {
+    s->unchanged = 0;
+    s->options = state_options_hash(m);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { if (errno != ENOENT) logf(1, "Warning: cannot open state '%s' (%s)", path, strerror(errno)); return; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(state_header_t)) { close(fd); return; }
+    s->len = (size_t)st.st_size;
+    s->map = mmap(NULL, s->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) { s->map = NULL; return; }
+    const state_header_t *h = (const state_header_t *)s->map;
+    if (memcmp(h->magic, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0 || h->version != STATE_VERSION ||
+        !h->n_slots || (h->n_slots & (h->n_slots - 1)) || h->slots_off > s->len ||
+        h->n_slots > (s->len - h->slots_off) / sizeof(state_slot_t) ||
+        h->names_off > s->len || h->names_size > s->len - h->names_off) {
+        logf(1, "Warning: ignoring invalid state file '%s'", path);
+        return;
+    }
+    if (h->options != s->options) { logf(1, "State: options changed since the last run, reading everything"); return; }
+    s->h = h;
+    s->slots = (const state_slot_t *)((const char *)s->map + h->slots_off);
+    s->names = (const char *)s->map + h->names_off;
+}
+
+// The previous run's slot for this directory if its mtime is unchanged, else NULL.
+static const state_slot_t *state_unchanged(const state_t *s, const struct stat *st, uint64_t ignores) {
+    if (!s->h) return NULL;
+    uint64_t mask = s->h->n_slots - 1;
+    for (uint64_t i = state_slot_hash(st->st_dev, st->st_ino) & mask, k = 0; k <= mask; i = (i + 1) & mask, k++) {
+        const state_slot_t *e = &s->slots[i];
+        if (!e->dev && !e->ino) return NULL;
+        if (e->dev != (uint64_t)st->st_dev || e->ino != (uint64_t)st->st_ino) continue;
+        if (e->mtime_ns != stat_mtime_ns(st) || e->ignores != ignores || e->names > s->h->names_size ||
+            e->names_len > s->h->names_size - e->names ||
+            (e->names_len && s->names[e->names + e->names_len - 1] != '\0')) return NULL;
+        return e;
+    }
+    return NULL;
+}
+
+static state_dir_t *state_dir_open(state_t *s, const char *path, const struct stat *st, uint64_t ignores) {
+    state_dir_t *d = (state_dir_t *)calloc(1, sizeof(*d)); if (!d) die("OOM");
+    d->dev = st->st_dev; d->ino = st->st_ino; d->mtime_ns = stat_mtime_ns(st); d->ignores = ignores;
+    d->path = xstrdup(path);
+    d->pending = 1;
+    struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
+    d->racy = d->mtime_ns + STATE_RACY_NS > (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    d->next = __atomic_load_n(&s->dirs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s->dirs, &d->next, d, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    return d;
+}
+static void state_add_child(state_dir_t *d, const char *name) {
+    if (!d) return;
+    size_t l = strlen(name) + 1;
+    if (d->len + l > d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 256;
+        while (d->len + l > d->cap) d->cap *= 2;
+        d->names = (char *)realloc(d->names, d->cap); if (!d->names) die("OOM");
+    }
+    memcpy(d->names + d->len, name, l);
+    d->len += l;
+}
+// Something in the directory is left to do: read it again next run.
+static void state_dirty(state_dir_t *d) {
+    if (d) __atomic_store_n(&d->dirty, true, __ATOMIC_RELAXED);
+}
+static void state_dir_hold(state_dir_t *d) {
+    if (d) __atomic_add_fetch(&d->pending, 1, __ATOMIC_RELAXED);
+}
+// Drops one pending reference; 'moved' tells whether a file left the
+// directory. The last one takes the mtime that the moves left behind.
+static void state_dir_release(state_dir_t *d, bool moved) {
+    if (!d) return;
+    if (moved) __atomic_store_n(&d->moved, true, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&d->pending, 1, __ATOMIC_ACQ_REL) != 0) return;
+    if (!__atomic_load_n(&d->moved, __ATOMIC_RELAXED) || __atomic_load_n(&d->dirty, __ATOMIC_RELAXED)) return;
+    struct stat st;
+    sys_add(SC_STAT);
+    if (stat(d->path, &st) != 0 || (uint64_t)st.st_dev != d->dev || (uint64_t)st.st_ino != d->ino) { state_dirty(d); return; }
+    d->mtime_ns = stat_mtime_ns(&st);
+}
+
+// Writes FILE.tmp and renames it over FILE; call once the run's jobs are finished.
+// Returns the number of directories recorded.
+static unsigned long state_write(const state_t *s, const char *path) {
+    // An mtime taken after the moves must have aged like the others.
+    struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
+    for (state_dir_t *d = s->dirs; d; d = d->next)
+        if (d->moved && d->mtime_ns + STATE_RACY_NS > (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec) d->racy = true;
+    uint64_t n = 0, names_size = 0;
+    for (state_dir_t *d = s->dirs; d; d = d->next)
+        if (!d->racy && !d->dirty) { n++; names_size += d->len; }
+    uint64_t n_slots = 16;
+    while (n_slots < n * 2) n_slots *= 2;
+    state_slot_t *slots = (state_slot_t *)calloc(n_slots, sizeof(state_slot_t)); if (!slots) die("OOM");
+    state_header_t h; memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+    h.version = STATE_VERSION; h.options = s->options;
+    h.n_slots = n_slots; h.slots_off = sizeof(h);
+    h.names_off = h.slots_off + n_slots * sizeof(state_slot_t); h.names_size = names_size;
+
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) die("Path too long: %s", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) { logf(1, "Warning: cannot write state '%s' (%s)", tmp, strerror(errno)); free(slots); return 0; }
+    uint64_t off = 0;
+    for (state_dir_t *d = s->dirs; d; d = d->next) {
+        if (d->racy || d->dirty) continue;
+        uint64_t i = state_slot_hash(d->dev, d->ino) & (n_slots - 1);
+        while (slots[i].dev || slots[i].ino) i = (i + 1) & (n_slots - 1);
+        slots[i] = (state_slot_t){ d->dev, d->ino, d->mtime_ns, d->ignores, off, d->len };
+        off += d->len;
+    }
+    bool ok = write_full(fd, (const char *)&h, sizeof(h)) &&
+              write_full(fd, (const char *)slots, n_slots * sizeof(state_slot_t));
+    for (state_dir_t *d = s->dirs; d && ok; d = d->next)
+        if (!d->racy && !d->dirty && d->len) ok = write_full(fd, d->names, d->len);
+    free(slots);
+    if (close(fd) != 0) ok = false;
+    if (!ok || rename(tmp, path) != 0) {
+        logf(1, "Warning: cannot write state '%s' (%s)", path, strerror(errno));
+        unlink(tmp);
+        return 0;
+    }
+    return (unsigned long)n;
+}
+
+static void state_free(state_t *s) {
+    state_dir_t *d = s->dirs;
+    while (d) { state_dir_t *next = d->next; free(d->path); free(d->names); free(d); d = next; }
+    s->dirs = NULL;
+    if (s->map) munmap(s->map, s->len);
+    s->map = NULL; s->h = NULL;
+}
+
+// ------------------------------ Traversal ------------------------------
+static bool is_under(const char *path, const char *prefix) {
     size_t n = strlen(prefix);
     if (strncmp(path, prefix, n) != 0) return false;
     return path[n] == '\0' || path[n] == '/';
 }
-static bool path_is_empty_dir(const char *dir) {
-    DIR *d = opendir(dir); if (!d) return false;
-    struct dirent *e; int count = 0;
-    while ((e = readdir(d)) != NULL) {
-        if (strcmp(e->d_name, ".")==0 || strcmp(e->d_name, "..")==0) continue;
-        count++; if (count>0) break;
+static void traverse_and_queue(mnf_t *m, const char *dir, const struct stat *dir_st, int depth,
+                               const char *relbase, const ignore_set_t *ign, src_dir_t *parent);
+static bool watch_dir(const char *dir, const struct stat *dir_st, int depth, const char *relbase,
+                      const ignore_set_t **ign, ignore_set_t *own, bool *has_own);
+static bool watch_busy(const char *path, const struct stat *st);
+
+// Handles one directory entry; returns false if it stays where it is.
+static bool queue_entry(mnf_t *m, const char *dir, int depth, const char *relbase,
+                        const ignore_set_t *ign, src_dir_t *node, state_dir_t *sd, const struct dirent *ent) {
+    const options_t *o = &m->opt;
+    if (o->ignore_files && strcmp(ent->d_name, IGNORE_FILE_NAME) == 0) return false;
+    char path[PATH_MAX];
+    if (!path_join(path, sizeof(path), dir, ent->d_name)) {
+        logf(1, "Warning: path too long: '%s/%s'", dir, ent->d_name);
+        state_dirty(sd);
+        return false;
+    }
+    char rel[PATH_MAX];
+    if (relbase && *relbase) snprintf(rel, sizeof(rel), "%s/%s", relbase, ent->d_name);
+    else snprintf(rel, sizeof(rel), "%s", ent->d_name);
+
+    // With a known d_type, ignored entries are dropped before they are even lstat'ed.
+    if (ign && ent->d_type != DT_UNKNOWN && ignore_check(ign, rel, ent->d_type == DT_DIR)) return false;
+
+    tls_op_path = path;
+    uint64_t t = op_begin();
+    sys_add(SC_STAT);
+    struct stat st;
+    if (lstat(path, &st) < 0) { logf(1, "lstat failed for '%s' (%s)", path, strerror(errno)); state_dirty(sd); return false; }
+    op_end(OP_LSTAT, t);
+    if (ign && ent->d_type == DT_UNKNOWN && ignore_check(ign, rel, S_ISDIR(st.st_mode))) return false;
+
+    if (S_ISDIR(st.st_mode)) {
+        sys_add(SC_REALPATH);
+        char subcanon[PATH_MAX];
+        if (!realpath(path, subcanon)) { logf(1, "realpath failed for '%s' (%s)", path, strerror(errno)); state_dirty(sd); return false; }
+        if (is_under(subcanon, m->dests.canon)) return false;
+        if (o->max_depth >= 0 && depth >= o->max_depth) return false;
+        traverse_and_queue(m, path, &st, depth + 1, rel, ign, node);
+        state_add_child(sd, ent->d_name);
+        return true;
+    }
+    if (!S_ISREG(st.st_mode) && !(S_ISLNK(st.st_mode) && o->include_symlinks)) return false;
+    if (o->max_depth >= 0 && depth > o->max_depth) return false;
+    if (depth < o->min_depth) return false;
+    if (!file_passes_filters(o, rel, &st, ent->d_name)) {
+        if (!file_passes_attr_filters(o, &st)) state_dirty(sd);
+        return false;
+    }
+    if (o->watch && S_ISREG(st.st_mode) && watch_busy(path, &st)) { state_dirty(sd); return false; }
+    job_t j = { .src_path = xstrdup(path), .rel_path = xstrdup(rel), .depth = depth,
+                .is_symlink = S_ISLNK(st.st_mode), .mtime = st.st_mtime,
+                .size = st.st_size, .dev = st.st_dev, .dir = node, .sd = sd };
+    src_dir_hold(node);
+    state_dir_hold(sd);
+    STAT_ADD(queued, 1);
+    STAT_ADD(bytes_queued, (unsigned long long)st.st_size);
+    push_job(m, &j);
+    return true;
+}
+
+// 'dir_st' is the stat of 'dir', taken before it is read.
+static void traverse_and_queue(mnf_t *m, const char *dir, const struct stat *dir_st, int depth,
+                               const char *relbase, const ignore_set_t *ign, src_dir_t *parent) {
+    const options_t *o = &m->opt;
+    tls_op_path = dir;
+    uint64_t t = op_begin();
+    ignore_set_t own = {0};
+    bool has_own = o->ignore_files && ignore_load(&own, ign, dir, relbase);
+    uint64_t ignores = own.stamp ? own.stamp : ign ? ign->stamp : 0;
+    if (has_own) ign = &own;
+    if (o->watch && !watch_dir(dir, dir_st, depth, relbase, &ign, &own, &has_own)) {
+        if (has_own) ignore_free(&own);
+        return;
+    }
+    state_dir_t *sd = o->state ? state_dir_open(m->state, dir, dir_st, ignores) : NULL;
+    const state_slot_t *known = sd ? state_unchanged(m->state, dir_st, ignores) : NULL;
+
+    DIR *d = NULL;
+    if (!known) {
+        uint64_t to = op_begin();
+        sys_add(SC_OPENDIR);
+        d = opendir(dir);
+        op_end(OP_OPENDIR, to);
+        if (!d) {
+            logf(1, "Warning: cannot open '%s' (%s)", dir, strerror(errno));
+            src_dir_keep(parent); state_dirty(sd);
+            if (has_own) ignore_free(&own);
+            return;
+        }
+    }
+    src_dir_t *node = (o->prune_empty_dirs && !o->dry_run) ? src_dir_open(dir, parent) : NULL;
+
+    if (known) {
+        // Unchanged since the last run: visit the remembered subdirectories only.
+        __atomic_add_fetch(&m->state->unchanged, 1, __ATOMIC_RELAXED);
+        src_dir_keep(node);
+        struct dirent ent; memset(&ent, 0, sizeof(ent));
+        ent.d_type = DT_UNKNOWN;
+        for (const char *n = m->state->names + known->names, *end = n + known->names_len; n < end; n += strlen(n) + 1) {
+            snprintf(ent.d_name, sizeof(ent.d_name), "%s", n);
+            if (!queue_entry(m, dir, depth, relbase, ign, node, sd, &ent)) state_dirty(sd);
+        }
+    } else {
+        struct dirent *ent;
+        while (sys_add(SC_READDIR), (ent = readdir(d)) != NULL) {
+            if (__atomic_load_n(&m->cancel, __ATOMIC_RELAXED)) { src_dir_keep(node); state_dirty(sd); break; }
+            if (strcmp(ent->d_name, ".")==0 || strcmp(ent->d_name, "..")==0) continue;
+            if (!queue_entry(m, dir, depth, relbase, ign, node, sd, ent)) src_dir_keep(node);
+        }
+        closedir(d);
+    }
+    if (has_own) ignore_free(&own);
+    src_dir_release(node, true);
+    state_dir_release(sd, false);
+    if (t) trace_span("directory", t, now_ns(), dir);
+}
+
+// Resolves the source roots of a run into m->roots. A root inside another one
+// (or given twice) is dropped, since that one's traversal finds its files
+// already. Returns false with a message in 'err' if a source is missing.
+static bool roots_resolve(mnf_t *m, const char *const *srcs, size_t n, char *err, size_t errlen) {
+    roots_t *roots = &m->roots;
+    char **all = (char **)calloc(n, sizeof(char *));
+    roots->canon = (char **)calloc(n, sizeof(char *));
+    if (!all || !roots->canon) die("OOM");
+    for (size_t i=0;i<n;i++) {
+        char canon[PATH_MAX];
+        if (!realpath(srcs[i], canon)) { snprintf(err, errlen, "source not found: %s", srcs[i]); free_strv(all, n); return false; }
+        all[i] = xstrdup(canon);
+    }
+    for (size_t i=0;i<n;i++) {
+        size_t k = 0; // a root containing this one; of equal ones the first stays
+        while (k < n && (k == i || !is_under(all[i], all[k]) || (k > i && strcmp(all[i], all[k]) == 0))) k++;
+        if (k < n && strcmp(all[i], all[k]) == 0) logf(1, "Note: source '%s' is given more than once.", all[i]);
+        else if (k < n) logf(1, "Note: source '%s' lies within '%s' and is read only once.", all[i], all[k]);
+        else roots->canon[roots->n++] = xstrdup(all[i]);
+    }
+    free_strv(all, n);
+    return true;
+}
+
+static void traverse_root(mnf_t *m, const char *root) {
+    struct stat st;
+    if (stat(root, &st) != 0) { logf(1, "Warning: cannot stat source '%s' (%s)", root, strerror(errno)); return; }
+    traverse_and_queue(m, root, &st, 0, "", NULL, NULL);
+}
+static void *traverse_main(void *arg) {
+    mnf_t *m = (mnf_t *)arg;
+    tls_verbose = m->opt.verbose;
+    trace_thread("traversal");
+    roots_t *roots = &m->roots;
+    for (size_t i; (i = __atomic_fetch_add(&roots->next, 1, __ATOMIC_RELAXED)) < roots->n; ) traverse_root(m, roots->canon[i]);
+    sink_flush_thread(false);
+    stats_slot_retire();
+    return NULL;
+}
+
+// Reads all source roots into the one job queue, up to TRAVERSE_THREADS of them
+// at the same time. With --watch they are read one after another on this
+// thread, which owns the watch table.
+#define TRAVERSE_THREADS 8
+static void traverse_sources(mnf_t *m) {
+    const roots_t *roots = &m->roots;
+    int nth = m->opt.watch || roots->n < 2 ? 0 : roots->n < TRAVERSE_THREADS ? (int)roots->n : TRAVERSE_THREADS;
+    if (!nth) {
+        for (size_t i=0;i<roots->n;i++) traverse_root(m, roots->canon[i]);
+        return;
+    }
+    pthread_t ths[TRAVERSE_THREADS];
+    for (int i=0;i<nth;i++)
+        if (pthread_create(&ths[i], NULL, traverse_main, m) != 0) die("pthread_create failed");
+    for (int i=0;i<nth;i++) pthread_join(ths[i], NULL);
+}
+
+static void roots_free(mnf_t *m) {
+    free_strv(m->roots.canon, m->roots.n);
+    memset(&m->roots, 0, sizeof(m->roots));
+}
+
+// ------------------------------ Watch ------------------------------
+// --watch: after the initial pass, mnf stays resident and moves files as they
+// arrive, with the worker pool, destination tables and filters kept warm.
+// Every directory the traversal reads gets an inotify watch before it is read,
+// so nothing created during the pass is missed. A file is taken when it is
+// closed after writing or renamed into a watched directory; a new or moved-in
+// directory is traversed (and watched) like during the pass. A file found by
+// reading a directory may still be open for writing; it is left for its own
+// IN_CLOSE_WRITE (see watch_busy()). When the event queue overflows, the
+// directories whose mtime changed since they were last read are read again,
+// and the files left for an IN_CLOSE_WRITE are looked at again, as that event
+// may be among the lost ones (closing a file does not change its directory's
+// mtime). The event loop runs on the traversal thread, which owns the watch
+// table; SIGINT and SIGTERM end it.
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+typedef struct { char **v; size_t n, cap; } path_list_t;
+
+typedef struct {
+    char *path, *rel;           // rel: below SOURCE_DIR, as traverse_and_queue() got it
+    int depth;                  // depth of its entries
+    int64_t mtime_ns;           // when it was last read (0: read it again on overflow)
+    const ignore_set_t *ign;    // rules for its entries (NULL: none)
+    ignore_set_t *own;          // its own ignore file, if any
+} watch_dir_t;
+
+static struct {
+    int fd, sig;                // inotify; signalfd for SIGINT/SIGTERM
+    watch_dir_t **dirs; size_t cap, n;  // indexed by watch descriptor
+    bool full;                  // out of watches (warned once)
+    bool closed, settling;      // handling IN_CLOSE_WRITE; looking at the settle list
+    path_list_t settle;         // files to look at again soon (no leases)
+    path_list_t busy;           // files left for their IN_CLOSE_WRITE
+    unsigned long events, rescans;
+} watch = { .fd = -1, .sig = -1 };
+#define WATCH_SETTLE_MS 1000
+
+// A directory changed within this long before it was read may change again
+// without a visible mtime change (coarse timestamps), so it is not trusted.
+#define WATCH_RACY_NS 1000000000LL
+static int64_t watch_mtime(const struct stat *st) {
+    struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
+    int64_t m = stat_mtime_ns(st);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec - m < WATCH_RACY_NS ? 0 : m;
+}
+
+static void path_list_add(path_list_t *l, const char *path) {
+    for (size_t i=0;i<l->n;i++) if (strcmp(l->v[i], path) == 0) return;
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 16;
+        l->v = (char **)realloc(l->v, l->cap * sizeof(char *)); if (!l->v) die("OOM");
+    }
+    l->v[l->n++] = xstrdup(path);
+}
+static void path_list_drop(path_list_t *l, const char *path) {
+    for (size_t i=0;i<l->n;i++)
+        if (strcmp(l->v[i], path) == 0) { free(l->v[i]); l->v[i] = l->v[--l->n]; return; }
+}
+
+// Blocks SIGINT/SIGTERM here and in every thread created afterwards; returns a
+// signalfd that reports them. Call before any thread is started.
+static int stop_signals(void) {
+    sigset_t set; sigemptyset(&set); sigaddset(&set, SIGINT); sigaddset(&set, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) die("pthread_sigmask failed");
+    int fd = signalfd(-1, &set, SFD_CLOEXEC);
+    if (fd < 0) die("signalfd failed (%s)", strerror(errno));
+    return fd;
+}
+
+static void watch_open(void) {
+    watch.sig = stop_signals();
+    watch.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (watch.sig < 0 || watch.fd < 0) die("Cannot watch the source (%s)", strerror(errno));
+    signal(SIGIO, SIG_IGN); // a lease broken while watch_busy() holds it
+}
+
+static void watch_free_dir(watch_dir_t *w) {
+    if (w->own) { ignore_free(w->own); free(w->own); }
+    free(w->path); free(w->rel); free(w);
+}
+// Forgets 'path' and everything below it; 'keep_wd' stays watched by the kernel.
+static void watch_forget(const char *path, int keep_wd) {
+    for (size_t wd=0;wd<watch.cap;wd++) {
+        watch_dir_t *w = watch.dirs[wd];
+        if (!w || !is_under(w->path, path)) continue;
+        if ((int)wd != keep_wd) inotify_rm_watch(watch.fd, (int)wd);
+        watch_free_dir(w); watch.dirs[wd] = NULL; watch.n--;
+    }
+}
+
+// Called by traverse_and_queue() before it reads 'dir'. Returns false if the
+// directory is already watched at this path, i.e. it has been read before. An
+// own ignore set moves into the watch table, which keeps it for later events.
+static bool watch_dir(const char *dir, const struct stat *dir_st, int depth, const char *relbase,
+                      const ignore_set_t **ign, ignore_set_t *own, bool *has_own) {
+    int wd = inotify_add_watch(watch.fd, dir, WATCH_MASK);
+    if (wd < 0) {
+        if (!watch.full) logf(1, "Warning: cannot watch '%s' (%s); later changes there are missed", dir, strerror(errno));
+        if (errno == ENOSPC) watch.full = true;
+        return true;
+    }
+    if ((size_t)wd >= watch.cap) {
+        size_t cap = watch.cap ? watch.cap : 1024;
+        while ((size_t)wd >= cap) cap *= 2;
+        watch.dirs = (watch_dir_t **)realloc(watch.dirs, cap * sizeof(*watch.dirs)); if (!watch.dirs) die("OOM");
+        memset(watch.dirs + watch.cap, 0, (cap - watch.cap) * sizeof(*watch.dirs));
+        watch.cap = cap;
+    }
+    watch_dir_t *w = watch.dirs[wd];
+    if (w && strcmp(w->path, dir) == 0) return false;
+    if (w) { // moved without us seeing it: read it again under its new path
+        char old[PATH_MAX]; snprintf(old, sizeof(old), "%s", w->path);
+        watch_forget(old, wd);
+    }
+    watch.n++;
+    w = (watch_dir_t *)calloc(1, sizeof(*w)); if (!w) die("OOM");
+    w->path = xstrdup(dir); w->rel = xstrdup(relbase); w->depth = depth;
+    w->mtime_ns = watch_mtime(dir_st);
+    if (*has_own) {
+        w->own = (ignore_set_t *)malloc(sizeof(*w->own)); if (!w->own) die("OOM");
+        *w->own = *own; *ign = w->own; *has_own = false;
+    }
+    w->ign = *ign;
+    watch.dirs[wd] = w;
+    return true;
+}
+
+// Called by queue_entry() for a regular file: true if it may still be open for
+// writing, so its own IN_CLOSE_WRITE takes it later. Only a file written to
+// within the last WATCH_SETTLE_MS is looked at, so the pass over an existing
+// tree costs no more than a plain run. A read lease is refused while any
+// writer has the file open. Where leases are not available (a file of another
+// user without CAP_LEASE, or a file system without them) the file is put on
+// the settle list instead, which watch_loop() looks at again. So is a file whose lease is
+// refused on IN_CLOSE_WRITE: the event is queued before the closing writer is
+// dropped, or another writer still has it open. Any other file whose lease is
+// refused goes on the busy list, which watch_rescan() looks at again.
+static bool watch_busy(const char *path, const struct stat *st) {
+    struct timespec now; clock_gettime(CLOCK_REALTIME, &now);
+    if ((int64_t)now.tv_sec * 1000000000LL + now.tv_nsec - stat_mtime_ns(st) >= WATCH_SETTLE_MS * 1000000LL) return false;
+    sys_add(SC_OPEN);
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return false; // the job reports it
+    sys_add(SC_OTHER);
+    int r = fcntl(fd, F_SETLEASE, F_RDLCK), err = errno;
+    if (r == 0) fcntl(fd, F_SETLEASE, F_UNLCK);
+    close(fd);
+    if (r == 0) return false;
+    if (err == EAGAIN) {
+        if (!watch.closed && !watch.settling) { path_list_add(&watch.busy, path); return true; }
+    } else if (watch.closed) return false;
+    path_list_add(&watch.settle, path);
+    return true;
+}
+// Offers the files on 'l' to queue_entry() again; those still written to go back
+// on a list. 'settling' is set for the settle list.
+static void watch_reoffer(mnf_t *m, path_list_t *l, bool settling) {
+    size_t n = l->n;
+    char **paths = l->v;
+    l->v = NULL; l->n = l->cap = 0;
+    watch.settling = settling;
+    for (size_t i=0;i<n;i++) {
+        char *slash = strrchr(paths[i], '/');
+        *slash = '\0';
+        for (size_t wd=0;wd<watch.cap;wd++) {
+            watch_dir_t *w = watch.dirs[wd];
+            if (!w || strcmp(w->path, paths[i]) != 0) continue;
+            struct dirent ent; memset(&ent, 0, sizeof(ent));
+            ent.d_type = DT_UNKNOWN;
+            snprintf(ent.d_name, sizeof(ent.d_name), "%s", slash + 1);
+            queue_entry(m, w->path, w->depth, w->rel, w->ign, NULL, NULL, &ent);
+            break;
+        }
+        free(paths[i]);
+    }
+    watch.settling = false;
+    free(paths);
+}
+
+// Events were lost: read the directories that changed since they were last
+// read, and look at the files that were left for an IN_CLOSE_WRITE again.
+static void watch_rescan(mnf_t *m) {
+    logf(1, "Warning: inotify queue overflowed; reading changed directories again");
+    watch.rescans++;
+    watch_reoffer(m, &watch.busy, false);
+    for (size_t wd=0;wd<watch.cap;wd++) {
+        watch_dir_t *w = watch.dirs[wd]; // the table grows while new directories are found
+        struct stat st;
+        if (!w || stat(w->path, &st) != 0 || stat_mtime_ns(&st) == w->mtime_ns) continue;
+        w->mtime_ns = watch_mtime(&st);
+        sys_add(SC_OPENDIR);
+        DIR *d = opendir(w->path);
+        if (!d) continue;
+        struct dirent *ent;
+        while (sys_add(SC_READDIR), (ent = readdir(d)) != NULL) {
+            if (strcmp(ent->d_name, ".")==0 || strcmp(ent->d_name, "..")==0) continue;
+            queue_entry(m, w->path, w->depth, w->rel, w->ign, NULL, NULL, ent);
+        }
+        closedir(d);
+    }
+}
+
+static void watch_event(mnf_t *m, const struct inotify_event *ev) {
+    watch.events++;
+    if (ev->mask & IN_Q_OVERFLOW) { watch_rescan(m); return; }
+    if (ev->wd < 0 || (size_t)ev->wd >= watch.cap || !watch.dirs[ev->wd]) return;
+    watch_dir_t *w = watch.dirs[ev->wd];
+    if (ev->mask & IN_IGNORED) { watch_free_dir(w); watch.dirs[ev->wd] = NULL; watch.n--; return; }
+    if (!ev->len) return;
+    if (ev->mask & IN_MOVED_FROM) {
+        // A directory renamed away; if it moved within the source, IN_MOVED_TO adds it again.
+        char path[PATH_MAX];
+        if ((ev->mask & IN_ISDIR) && path_join(path, sizeof(path), w->path, ev->name)) watch_forget(path, -1);
+        return;
     }
-    closedir(d);
-    return count == 0;
-}
-static void prune_empty(const char *dir) {
-    DIR *d = opendir(dir); if (!d) return;
-    struct dirent *e;
-    while ((e = readdir(d)) != NULL) {
-        if (strcmp(e->d_name, ".")==0 || strcmp(e->d_name, "..")==0) continue;
-        char path[PATH_MAX]; path_join(path, sizeof(path), dir, e->d_name);
-        struct stat st; if (lstat(path, &st) != 0) continue;
-        if (S_ISDIR(st.st_mode)) {
-            char subcanon[PATH_MAX]; if (!realpath(path, subcanon)) continue;
-            if (is_under(subcanon, DST_CANON)) continue;
-            prune_empty(path);
-            if (path_is_empty_dir(path)) { rmdir(path); }
+    if ((ev->mask & IN_CREATE) && !(ev->mask & IN_ISDIR)) return; // taken when closed
+    char path[PATH_MAX];
+    if ((watch.settle.n || watch.busy.n) && path_join(path, sizeof(path), w->path, ev->name)) {
+        path_list_drop(&watch.settle, path);
+        path_list_drop(&watch.busy, path);
+    }
+    struct dirent ent; memset(&ent, 0, sizeof(ent));
+    ent.d_type = (ev->mask & IN_ISDIR) ? DT_DIR : DT_UNKNOWN;
+    snprintf(ent.d_name, sizeof(ent.d_name), "%s", ev->name);
+    watch.closed = (ev->mask & IN_CLOSE_WRITE) != 0;
+    queue_entry(m, w->path, w->depth, w->rel, w->ign, NULL, NULL, &ent);
+    watch.closed = false;
+}
+
+// Runs until SIGINT or SIGTERM.
+static void watch_loop(mnf_t *m) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd p[2] = { { watch.fd, POLLIN, 0 }, { watch.sig, POLLIN, 0 } };
+    logf(1, "Watching %zu directories (Ctrl-C to stop)", watch.n);
+    uint64_t settle_at = 0;
+    for (;;) {
+        sink_flush_thread(false);
+        if (watch.settle.n && !settle_at) settle_at = now_ns() + WATCH_SETTLE_MS * 1000000ULL;
+        int timeout = -1;
+        if (settle_at) { uint64_t t = now_ns(); timeout = t >= settle_at ? 0 : (int)((settle_at - t) / 1000000) + 1; }
+        int r = poll(p, 2, timeout);
+        if (r < 0) { if (errno == EINTR) continue; die("poll failed (%s)", strerror(errno)); }
+        if (p[1].revents) break;
+        if (settle_at && now_ns() >= settle_at) { settle_at = 0; watch_reoffer(m, &watch.settle, true); }
+        if (!p[0].revents) continue;
+        ssize_t len = read(watch.fd, buf, sizeof(buf));
+        if (len < 0) { if (errno == EINTR || errno == EAGAIN) continue; die("Cannot read inotify events (%s)", strerror(errno)); }
+        for (char *e = buf; e < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)e;
+            e += sizeof(*ev) + ev->len;
+            watch_event(m, ev);
         }
     }
-    closedir(d);
+    struct signalfd_siginfo si;
+    if (read(watch.sig, &si, sizeof(si)) == (ssize_t)sizeof(si)) logf(1, "Stopping on %s", strsignal((int)si.ssi_signo));
+}
+
+static void watch_close(void) {
+    if (watch.fd < 0) return;
+    for (size_t wd=0;wd<watch.cap;wd++) if (watch.dirs[wd]) watch_free_dir(watch.dirs[wd]);
+    free(watch.dirs);
+    free_strv(watch.settle.v, watch.settle.n);
+    free_strv(watch.busy.v, watch.busy.n);
+    close(watch.fd); close(watch.sig);
+    watch.fd = watch.sig = -1;
 }
 
-typedef struct job job_t;
-static bool file_passes_filters(const options_t *o, const char *rel, const struct stat *st, const char *name);
+// ------------------------------ Service ------------------------------
+// --serve SOCKET: a resident mnf that takes move requests over a unix socket,
+// so small batches do not pay for process start, thread creation, option
+// parsing and filter setup. A request is one line of tab-separated fields,
+//     SOURCE_DIR <TAB> DEST_DIR [<TAB> priority=N] [<TAB> dry-run] [<TAB> NAME=VALUE]...
+// where NAME is --mode or one of the depth and filter options; a request's
+// list (--include, --exclude, --allow-ext, --deny-ext) replaces the server's.
+// The connection stays open for the replies: "queued ID", "started ID", a
+// "progress DONE/QUEUED" line every second and a final "done ..." or
+// "error ..." line. An acceptor thread reads request lines from all new
+// connections at once, without blocking, into a list ordered by priority
+// (higher first, then arrival). The main thread starts up to SERVE_RUNS_MAX
+// of them at once, each on a thread and handle of its own, as a handle has one
+// SOURCE_DIR, DEST_DIR and set of destination tables at a time; a request
+// whose SOURCE_DIR overlaps a running one's waits for it. A finished
+// handle is kept with its pool and tables, and taken again by a request into
+// the same DEST_DIR. The server's --journal and --undo-log serve all handles.
+// The socket is only open to its owner (0600).
+#define SERVE_LINE_MAX (4 * PATH_MAX)
+#define SERVE_READ_MS 5000      // a client has this long to send its request line
+#define SERVE_PENDING_MAX 64    // connections being read; more wait in the backlog
+#define SERVE_RUNS_MAX 4        // requests running at once; more wait in the list
 
-static void traverse_and_queue(const options_t *o, const char *dir, int depth, const char *relbase) {
-    DIR *d = opendir(dir);
-    if (!d) { logf(1, "Warning: cannot open '%s' (%s)", dir, strerror(errno)); return; }
-    struct dirent *ent;
+typedef struct request {
+    int fd;
+    unsigned long id;
+    int priority;
+    bool dry_run;
+    char *src, *dst;
+    char *canon;                // SOURCE_DIR resolved, to keep overlapping runs apart
+    options_t opt;              // the server's options with this request's applied
+    unsigned own_lists;         // bit i: list i (see request_lists()) belongs to the request
+    struct request *next;
+} request_t;
+
+// A connection whose request line is still being read.
+typedef struct {
+    int fd;
+    size_t len;
+    uint64_t deadline;
+    char line[SERVE_LINE_MAX];
+} serve_conn_t;
+
+static struct {
+    int sock, sig;              // listening socket; signalfd for SIGINT/SIGTERM
+    const char *path;
+    options_t base;             // the command line's run options, for requests
+    pthread_t th;
+    pthread_mutex_t mx; pthread_cond_t cv;
+    request_t *head;            // waiting requests, by priority
+    request_t *running[SERVE_RUNS_MAX]; size_t n_running;
+    mnf_t *idle[SERVE_RUNS_MAX]; size_t n_idle; // handles of finished requests
+    unsigned long next_id, served;
+    bool stop;
+} srv = { .sock = -1, .sig = -1, .mx = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER };
+
+typedef struct {
+    unsigned long moved, skipped, failed, deduped, queued;
+    unsigned long long bytes;   // size of the finished files
+} run_counts_t;
+
+// Best effort: a client that went away does not stop the request.
+static void serve_reply(int fd, const char *fmt, ...) {
+    char buf[PATH_MAX + 128];
+    va_list ap; va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n > sizeof(buf) - 2) n = (int)sizeof(buf) - 2;
+    buf[n++] = '\n';
+    for (int off = 0; off < n; ) {
+        ssize_t w = send(fd, buf + off, (size_t)(n - off), MSG_NOSIGNAL);
+        if (w < 0) { if (errno == EINTR) continue; return; }
+        off += (int)w;
+    }
+}
+
+// The list options a request may replace, in own_lists bit order.
+static void request_lists(options_t *o, char ***lists[4], size_t *counts[4]) {
+    lists[0] = &o->includes; counts[0] = &o->n_includes;
+    lists[1] = &o->excludes; counts[1] = &o->n_excludes;
+    lists[2] = &o->allow_ext; counts[2] = &o->n_allow_ext;
+    lists[3] = &o->deny_ext; counts[3] = &o->n_deny_ext;
+}
+
+static void request_free(request_t *r) {
+    if (r->fd >= 0) close(r->fd);
+    char ***lists[4]; size_t *counts[4];
+    request_lists(&r->opt, lists, counts);
+    for (int i=0;i<4;i++) if (r->own_lists & (1u << i)) free_strv(*lists[i], *counts[i]);
+    free(r->src); free(r->dst); free(r->canon); free(r);
+}
 
-    while ((ent = readdir(d)) != NULL) {
-        if (strcmp(ent->d_name, ".")==0 || strcmp(ent->d_name, "..")==0) continue;
-        char path[PATH_MAX]; path_join(path, sizeof(path), dir, ent->d_name);
-        char rel[PATH_MAX];
-        if (relbase && *relbase) snprintf(rel, sizeof(rel), "%s/%s", relbase, ent->d_name);
-        else snprintf(rel, sizeof(rel), "%s", ent->d_name);
-
-        struct stat st; if (lstat(path, &st) < 0) { logf(1, "lstat failed for '%s' (%s)", path, strerror(errno)); continue; }
-
-        if (S_ISLNK(st.st_mode)) {
-            if (!o->include_symlinks) continue;
-            if (o->max_depth >= 0 && depth > o->max_depth) continue;
-            if (depth >= o->min_depth) {
-                if (!file_passes_filters(o, rel, &st, ent->d_name)) continue;
-                job_t j = { .src_path = xstrdup(path), .rel_path = xstrdup(rel), .depth = depth, .is_symlink = true };
-                push_job(&j);
+// Parses one request line; replies and returns NULL if it is not valid.
+static request_t *serve_parse(int c, char *line) {
+    request_t *r = (request_t *)calloc(1, sizeof(*r)); if (!r) die("OOM");
+    r->fd = c;
+    r->opt = srv.base;
+    char ***lists[4]; size_t *counts[4];
+    request_lists(&r->opt, lists, counts);
+    char *save = NULL;
+    for (char *f = strtok_r(line, "\t", &save); f; f = strtok_r(NULL, "\t", &save)) {
+        if (!r->src) { r->src = xstrdup(f); continue; }
+        if (!r->dst) { r->dst = xstrdup(f); continue; }
+        if (strncmp(f, "priority=", 9) == 0) { r->priority = atoi(f + 9); continue; }
+        if (strcmp(f, "dry-run") == 0) { r->dry_run = true; continue; }
+        const char *eq = strchr(f, '=');
+        const struct option *l = longopts;
+        while (eq && l->name && !(is_run_option(l->val) && strlen(l->name) == (size_t)(eq - f) && strncmp(l->name, f, (size_t)(eq - f)) == 0)) l++;
+        if (!eq || !l->name) { serve_reply(c, "error unknown field '%s'", f); request_free(r); return NULL; }
+        for (int i=0;i<4;i++) {
+            if (l->val != 1007 + i || (r->own_lists & (1u << i))) continue;
+            *lists[i] = NULL; *counts[i] = 0; r->own_lists |= 1u << i;
+        }
+        if (!set_run_option(&r->opt, l->val, eq + 1)) {
+            serve_reply(c, "error invalid %s: %s", l->name, eq + 1); request_free(r); return NULL;
+        }
+    }
+    if (!r->dst) { serve_reply(c, "error expected SOURCE_DIR<TAB>DEST_DIR"); request_free(r); return NULL; }
+    if (!(r->canon = realpath(r->src, NULL))) r->canon = xstrdup(r->src);
+    return r;
+}
+
+// Takes what the client has sent so far; returns false once the connection is
+// done with: a request was queued, or the client was answered with an error.
+static bool serve_read(serve_conn_t *cn) {
+    for (;;) {
+        ssize_t r = read(cn->fd, cn->line + cn->len, sizeof(cn->line) - 1 - cn->len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EAGAIN) return true;
+        if (r > 0) cn->len += (size_t)r;
+        cn->line[cn->len] = '\0';
+        char *nl = strchr(cn->line, '\n');
+        if (!nl && r > 0 && cn->len < sizeof(cn->line) - 1) continue;
+        if (!nl) { serve_reply(cn->fd, "error incomplete request"); close(cn->fd); return false; }
+        *nl = '\0';
+        if (nl > cn->line && nl[-1] == '\r') nl[-1] = '\0';
+        // Replies are written blocking, each with a bounded wait.
+        fcntl(cn->fd, F_SETFL, fcntl(cn->fd, F_GETFL) & ~O_NONBLOCK);
+        struct timeval tv = { SERVE_READ_MS / 1000, 0 };
+        setsockopt(cn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        request_t *q = serve_parse(cn->fd, cn->line);
+        if (!q) return false;
+        q->id = ++srv.next_id; // only this thread numbers requests
+        serve_reply(q->fd, "queued %lu", q->id);
+        mx_lock(&srv.mx, LOCK_SERVE);
+        request_t **pp = &srv.head;
+        while (*pp && (*pp)->priority >= q->priority) pp = &(*pp)->next;
+        q->next = *pp; *pp = q;
+        pthread_cond_signal(&srv.cv);
+        pthread_mutex_unlock(&srv.mx);
+        return false;
+    }
+}
+
+static void *serve_main(void *arg) {
+    (void)arg;
+    tls_verbose = srv.base.verbose;
+    trace_thread("acceptor");
+    serve_conn_t *conns[SERVE_PENDING_MAX];
+    struct pollfd p[2 + SERVE_PENDING_MAX];
+    size_t n = 0;
+    for (;;) {
+        p[0] = (struct pollfd){ srv.sock, n < SERVE_PENDING_MAX ? POLLIN : 0, 0 };
+        p[1] = (struct pollfd){ srv.sig, POLLIN, 0 };
+        uint64_t now = now_ns(), first = 0;
+        for (size_t i=0;i<n;i++) {
+            p[2 + i] = (struct pollfd){ conns[i]->fd, POLLIN, 0 };
+            if (!first || conns[i]->deadline < first) first = conns[i]->deadline;
+        }
+        int timeout = !first ? -1 : first <= now ? 0 : (int)((first - now) / 1000000) + 1;
+        if (poll(p, 2 + n, timeout) < 0) { if (errno == EINTR) continue; die("poll failed (%s)", strerror(errno)); }
+        if (p[1].revents) {
+            struct signalfd_siginfo si;
+            if (read(srv.sig, &si, sizeof(si)) == (ssize_t)sizeof(si)) logf(1, "Stopping on %s", strsignal((int)si.ssi_signo));
+            break;
+        }
+        now = now_ns();
+        for (size_t i = n; i-- > 0; ) {
+            serve_conn_t *cn = conns[i];
+            bool keep = true;
+            if (p[2 + i].revents) keep = serve_read(cn);
+            else if (now >= cn->deadline) { serve_reply(cn->fd, "error incomplete request"); close(cn->fd); keep = false; }
+            if (!keep) { free(cn); conns[i] = conns[--n]; }
+        }
+        if (p[0].revents & POLLIN) {
+            int c = accept4(srv.sock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (c >= 0) {
+                serve_conn_t *cn = (serve_conn_t *)malloc(sizeof(*cn)); if (!cn) die("OOM");
+                cn->fd = c; cn->len = 0; cn->deadline = now + SERVE_READ_MS * 1000000ULL;
+                conns[n++] = cn;
             }
-            continue;
         }
-        if (S_ISDIR(st.st_mode)) {
-            char subcanon[PATH_MAX]; if (!realpath(path, subcanon)) { logf(1, "realpath failed for '%s' (%s)", path, strerror(errno)); continue; }
-            if (is_under(subcanon, DST_CANON)) continue;
-            if (o->max_depth >= 0 && depth >= o->max_depth) continue;
-            traverse_and_queue(o, path, depth + 1, rel);
-        } else if (S_ISREG(st.st_mode)) {
-            if (o->max_depth >= 0 && depth > o->max_depth) continue;
-            if (depth >= o->min_depth) {
-                if (!file_passes_filters(o, rel, &st, ent->d_name)) continue;
-                job_t j = { .src_path = xstrdup(path), .rel_path = xstrdup(rel), .depth = depth, .is_symlink = false };
-                push_job(&j);
+        sink_flush_thread(false);
+    }
+    for (size_t i=0;i<n;i++) { serve_reply(conns[i]->fd, "error server stopping"); close(conns[i]->fd); free(conns[i]); }
+    mx_lock(&srv.mx, LOCK_SERVE);
+    srv.stop = true;
+    pthread_cond_signal(&srv.cv);
+    pthread_mutex_unlock(&srv.mx);
+    sink_flush_thread(false);
+    stats_slot_retire();
+    return NULL;
+}
+
+static void serve_start(const char *path, const mnf_t *m) {
+    srv.path = path;
+    srv.base = m->opt;
+    struct sockaddr_un sa; memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) die("Socket path too long: %s", path);
+    strcpy(sa.sun_path, path);
+    struct stat st; // replace a stale socket, never anything else
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    srv.sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    // Nobody can connect before listen(), so the mode is set in time.
+    if (srv.sock < 0 || bind(srv.sock, (struct sockaddr *)&sa, sizeof(sa)) != 0 || chmod(path, 0600) != 0 ||
+        listen(srv.sock, 64) != 0)
+        die("Cannot listen on %s (%s)", path, strerror(errno));
+    if (pthread_create(&srv.th, NULL, serve_main, NULL) != 0) die("pthread_create failed");
+}
+
+// A run's counts: what the handle's workers finished since 'before' was taken.
+static void run_counts(const mnf_t *m, run_counts_t *c) {
+    memset(c, 0, sizeof(*c));
+    for (int i=0; m->slots && i<m->nth; i++) {
+        const stats_slot_t *s = m->slots[i];
+        c->moved += __atomic_load_n(&s->moved, __ATOMIC_RELAXED);
+        c->skipped += __atomic_load_n(&s->skipped, __ATOMIC_RELAXED);
+        c->failed += __atomic_load_n(&s->failed, __ATOMIC_RELAXED);
+        c->deduped += __atomic_load_n(&s->deduped, __ATOMIC_RELAXED);
+        c->bytes += __atomic_load_n(&s->bytes_done, __ATOMIC_RELAXED);
+    }
+    c->queued = __atomic_load_n(&m->q.queued, __ATOMIC_RELAXED);
+}
+static void run_counts_since(const mnf_t *m, const run_counts_t *before, run_counts_t *c) {
+    run_counts(m, c);
+    c->moved -= before->moved; c->skipped -= before->skipped; c->failed -= before->failed;
+    c->deduped -= before->deduped; c->queued -= before->queued; c->bytes -= before->bytes;
+}
+
+// Waits until every queued job is finished and all workers are idle, calling
+// 'progress' (if set) about once a second with the counts since 'before'.
+static void run_wait(mnf_t *m, const run_counts_t *before, void (*progress)(void *, const run_counts_t *), void *arg) {
+    queue_t *q = &m->q;
+    mx_lock(&q->mx, LOCK_QUEUE);
+    while (__atomic_load_n(&q->pending, __ATOMIC_ACQUIRE) || q->sleeping < m->nth) {
+        struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts); ts.tv_sec += 1;
+        if (pthread_cond_timedwait(&q->idle, &q->mx, &ts) != ETIMEDOUT || !progress) continue;
+        pthread_mutex_unlock(&q->mx);
+        run_counts_t c; run_counts_since(m, before, &c);
+        progress(arg, &c);
+        mx_lock(&q->mx, LOCK_QUEUE);
+    }
+    pthread_mutex_unlock(&q->mx);
+}
+
+// Resolves a run's source roots and DEST_DIR and sets up the destination
+// tables, which are kept while runs go into the same DEST_DIR and nothing was
+// simulated in them. Returns false with a message in 'err' if a directory is
+// unusable.
+static bool run_prepare(mnf_t *m, const char *const *srcs, size_t n, const char *dst_arg, bool dry_run,
+                        char *err, size_t errlen) {
+    char dst[PATH_MAX];
+    struct stat st, dstst, rst;
+    dests_t *ds = &m->dests;
+    roots_free(m);
+    if (!roots_resolve(m, srcs, n, err, errlen)) return false;
+    if (access(dst_arg, F_OK) != 0 && mkdir(dst_arg, 0775) != 0) { snprintf(err, errlen, "cannot create destination: %s", dst_arg); return false; }
+    if (!realpath(dst_arg, dst)) { snprintf(err, errlen, "cannot resolve destination: %s", dst_arg); return false; }
+    for (size_t i=0;i<m->roots.n;i++) {
+        const char *src = m->roots.canon[i];
+        if (stat(src, &st) != 0 || !S_ISDIR(st.st_mode)) { snprintf(err, errlen, "not a directory: %s", src); return false; }
+    }
+    if (stat(dst, &dstst) != 0 || !S_ISDIR(dstst.st_mode)) { snprintf(err, errlen, "not a directory: %s", dst); return false; }
+    if (!dry_run && access(dst, W_OK) != 0) { snprintf(err, errlen, "no write permission in destination: %s", dst); return false; }
+
+    bool keep = m->dest_ready && !ds->sim && !dry_run && strcmp(dst, ds->canon) == 0 &&
+                fstat(ds->root.fd, &rst) == 0 && rst.st_dev == dstst.st_dev && rst.st_ino == dstst.st_ino;
+    if (!keep) {
+        if (m->dest_ready) dest_free(ds);
+        m->dest_ready = false;
+        snprintf(ds->canon, sizeof(ds->canon), "%s", dst);
+        if (!dest_init(ds)) { snprintf(err, errlen, "cannot open destination: %s (%s)", dst, strerror(errno)); return false; }
+        m->dest_ready = true;
+    }
+    ds->sim = m->opt.dry_run = dry_run;
+    return true;
+}
+
+static void plan_queue(mnf_t *m);
+
+// Queues a prepared run (from its sources, or from --plan-in) and waits until
+// every job is finished; with --watch it keeps going until SIGINT or SIGTERM.
+static void run_tree(mnf_t *m, const run_counts_t *before, void (*progress)(void *, const run_counts_t *), void *arg) {
+    uint64_t t = now_ns();
+    if (m->opt.plan_in) plan_queue(m);
+    else traverse_sources(m);
+    add_phase(PHASE_TRAVERSE, now_ns() - t);
+    __atomic_store_n(&m->traversed, true, __ATOMIC_RELEASE);
+    if (m->opt.watch) watch_loop(m);
+    sink_flush_thread(false);
+    run_wait(m, before, progress, arg);
+}
+
+static void serve_progress(void *arg, const run_counts_t *c) {
+    serve_reply(*(const int *)arg, "progress %lu/%lu", c->moved + c->skipped + c->failed + c->deduped, c->queued);
+}
+
+static void serve_run(mnf_t *m, const request_t *r) {
+    char err[PATH_MAX + 64];
+    const char *src = r->src;
+    if (!run_prepare(m, &src, 1, r->dst, r->dry_run, err, sizeof(err))) { serve_reply(r->fd, "error %s", err); return; }
+    logf(1, "Request %lu: %s -> %s%s", r->id, m->roots.canon[0], m->dests.canon, r->dry_run ? " (dry run)" : "");
+    serve_reply(r->fd, "started %lu", r->id);
+    run_counts_t before, c;
+    run_counts(m, &before);
+    run_tree(m, &before, serve_progress, (void *)&r->fd);
+    run_counts_since(m, &before, &c);
+    serve_reply(r->fd, "done moved=%lu skipped=%lu failed=%lu deduped=%lu bytes=%llu",
+                c.moved, c.skipped, c.failed, c.deduped, c.bytes);
+}
+
+static mnf_t *handle_new(void);
+static void handle_open(mnf_t *m);
+static void handle_free(mnf_t *m);
+static void start_workers(mnf_t *m);
+
+// A handle for request 'r': a finished one that last moved into the same
+// DEST_DIR, else a new one, else the oldest finished one. The run files are
+// the server's.
+static mnf_t *serve_handle(mnf_t *m, const request_t *r) {
+    char dst[PATH_MAX];
+    bool known = realpath(r->dst, dst) != NULL;
+    mx_lock(&srv.mx, LOCK_SERVE);
+    size_t i = 0;
+    while (i < srv.n_idle && !(known && srv.idle[i]->dest_ready && strcmp(srv.idle[i]->dests.canon, dst) == 0)) i++;
+    mnf_t *h = NULL;
+    if (i < srv.n_idle || srv.n_idle + srv.n_running > SERVE_RUNS_MAX) {
+        if (i == srv.n_idle) i = 0;
+        h = srv.idle[i];
+        memmove(&srv.idle[i], &srv.idle[i + 1], (srv.n_idle - i - 1) * sizeof(*srv.idle));
+        srv.n_idle--;
+    }
+    pthread_mutex_unlock(&srv.mx);
+    if (h) return h;
+    if (!(h = handle_new())) die("OOM");
+    free(h->jr); free(h->undo);
+    h->jr = m->jr; h->undo = m->undo;
+    h->opt = srv.base; h->opt.serve = NULL;
+    handle_open(h);
+    return h;
+}
+
+// Frees a request handle; its options and run files belong to the server.
+static void serve_handle_free(mnf_t *h) {
+    h->jr = NULL; h->undo = NULL;
+    memset(&h->opt, 0, sizeof(h->opt));
+    handle_free(h);
+}
+
+typedef struct { mnf_t *h; request_t *r; } serve_task_t;
+
+static void *serve_request_main(void *arg) {
+    serve_task_t t = *(serve_task_t *)arg;
+    free(arg);
+    tls_verbose = t.r->opt.verbose;
+    trace_thread("request");
+    if (!t.h->ths) start_workers(t.h);
+    serve_run(t.h, t.r);
+    t.h->opt = srv.base; t.h->opt.serve = NULL; // the request's lists go with it
+    mx_lock(&srv.mx, LOCK_SERVE);
+    size_t i = 0;
+    while (srv.running[i] != t.r) i++;
+    srv.running[i] = srv.running[--srv.n_running];
+    srv.idle[srv.n_idle++] = t.h;
+    srv.served++;
+    pthread_cond_signal(&srv.cv);
+    pthread_mutex_unlock(&srv.mx);
+    request_free(t.r);
+    sink_flush_thread(false);
+    stats_slot_retire();
+    return NULL;
+}
+
+// The first waiting request whose SOURCE_DIR no running request overlaps; with srv.mx held.
+static request_t **serve_next(void) {
+    for (request_t **pp = &srv.head; *pp; pp = &(*pp)->next) {
+        size_t i = 0;
+        while (i < srv.n_running && !is_under((*pp)->canon, srv.running[i]->canon) &&
+               !is_under(srv.running[i]->canon, (*pp)->canon)) i++;
+        if (i == srv.n_running) return pp;
+    }
+    return NULL;
+}
+
+// Starts requests until SIGINT or SIGTERM, then lets the running ones finish;
+// requests still waiting are refused.
+static void serve_loop(mnf_t *m) {
+    bool dry_run = m->opt.dry_run;
+    logf(1, "Serving on %s (Ctrl-C to stop)", srv.path);
+    sink_flush_thread(false);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        mx_lock(&srv.mx, LOCK_SERVE);
+        request_t **pp = NULL;
+        while (!srv.stop && (srv.n_running >= SERVE_RUNS_MAX || !(pp = serve_next()))) pthread_cond_wait(&srv.cv, &srv.mx);
+        request_t *r = srv.stop ? NULL : *pp;
+        if (r) { *pp = r->next; srv.running[srv.n_running++] = r; }
+        pthread_mutex_unlock(&srv.mx);
+        if (!r) break;
+        r->dry_run = r->dry_run || dry_run;
+        serve_task_t *t = (serve_task_t *)malloc(sizeof(*t)); if (!t) die("OOM");
+        t->h = serve_handle(m, r); t->r = r;
+        t->h->opt = r->opt; t->h->opt.serve = NULL; // the handle's workers are idle
+        pthread_t th;
+        if (pthread_create(&th, &attr, serve_request_main, t) != 0) die("pthread_create failed");
+    }
+    pthread_attr_destroy(&attr);
+    pthread_join(srv.th, NULL);
+    mx_lock(&srv.mx, LOCK_SERVE);
+    while (srv.n_running) pthread_cond_wait(&srv.cv, &srv.mx);
+    pthread_mutex_unlock(&srv.mx);
+    for (size_t i=0;i<srv.n_idle;i++) serve_handle_free(srv.idle[i]);
+    srv.n_idle = 0;
+    for (request_t *r = srv.head, *next; r; r = next) {
+        next = r->next;
+        serve_reply(r->fd, "error server stopping");
+        request_free(r);
+    }
+    srv.head = NULL;
+    close(srv.sock); unlink(srv.path); close(srv.sig);
+}
+
+// ------------------------------ Plan files ------------------------------
+// --plan-out FILE keeps what a dry run decided; --plan-in FILE executes it
+// later without traversing or filtering again. A plan is a header, an array of
+// fixed-size records and a table of NUL-terminated strings the records point
+// into, in native byte order. --plan-in maps the file and queues the records
+// with paths pointing straight into the mapping.
+#define PLAN_MAGIC "MNFPLAN"
+#define PLAN_VERSION 1
+#define PLAN_F_SYMLINK 1u
+#define PLAN_F_DUP     2u   // identical to the target: the source is dropped
+
+typedef struct {
+    char magic[8];
+    uint32_t version, rec_size;
+    uint64_t n_recs, recs_off, strs_off, strs_size;
+    uint64_t src, dst;          // SOURCE_DIR and DEST_DIR (string offsets)
+    uint32_t mode, layout;      // settings the plan was made with
+    int64_t created;
+} plan_header_t;
+
+typedef struct {
+    uint64_t src, target;       // string offsets; target is relative to DEST_DIR
+    uint64_t size;
+    int64_t mtime;
+    uint32_t method;            // predicted move_method_t
+    uint32_t flags;
+} plan_rec_t;
+
+// Each worker appends to its own part; parts are concatenated on write. A
+// worker serves one handle, so its part stays with that handle's plan.
+typedef struct plan_part {
+    plan_rec_t *recs; size_t n, cap;
+    char *strs; size_t slen, scap;
+    struct plan_part *next;
+} plan_part_t;
+static __thread plan_part_t *tls_plan;
+
+typedef struct plan {
+    plan_part_t *parts;         // --plan-out
+    void *map; size_t len;      // --plan-in
+    const plan_header_t *h;
+    const plan_rec_t *recs;
+    const char *strs;
+} plan_t;
+
+static uint64_t plan_str(plan_part_t *p, const char *s) {
+    size_t len = strlen(s) + 1;
+    if (p->slen + len > p->scap) {
+        if (!p->scap) p->scap = 64 * 1024;
+        while (p->slen + len > p->scap) p->scap *= 2;
+        p->strs = (char *)realloc(p->strs, p->scap); if (!p->strs) die("OOM");
+    }
+    memcpy(p->strs + p->slen, s, len);
+    p->slen += len;
+    return p->slen - len;
+}
+
+// Records a job the dry run would move or drop.
+static void plan_note(const mnf_t *m, const job_t *j, job_result_t r, const job_out_t *out) {
+    if (r != JOB_WOULD_MOVE && r != JOB_WOULD_DROP) return;
+    plan_part_t *p = tls_plan;
+    if (!p) {
+        p = (plan_part_t *)calloc(1, sizeof(*p)); if (!p) die("OOM");
+        p->next = __atomic_load_n(&m->plan->parts, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&m->plan->parts, &p->next, p, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+        tls_plan = p;
+    }
+    if (p->n == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 1024;
+        p->recs = (plan_rec_t *)realloc(p->recs, p->cap * sizeof(plan_rec_t)); if (!p->recs) die("OOM");
+    }
+    const char *target = out->target + strlen(m->dests.canon);
+    while (*target == '/') target++;
+    plan_rec_t *rec = &p->recs[p->n++];
+    rec->src = plan_str(p, j->src_path);
+    rec->target = plan_str(p, target);
+    rec->size = (uint64_t)j->size;
+    rec->mtime = (int64_t)j->mtime;
+    rec->method = (uint32_t)out->method;
+    rec->flags = (j->is_symlink ? PLAN_F_SYMLINK : 0) | (r == JOB_WOULD_DROP ? PLAN_F_DUP : 0);
+}
+
+// Writes FILE.tmp and renames it over FILE once complete; call once the run's jobs are finished.
+static unsigned long plan_write(const char *path, const mnf_t *m) {
+    const options_t *o = &m->opt;
+    const char *src = m->roots.canon[0], *dst = m->dests.canon;
+    plan_header_t h; memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PLAN_MAGIC, sizeof(PLAN_MAGIC));
+    h.version = PLAN_VERSION; h.rec_size = sizeof(plan_rec_t);
+    h.mode = (uint32_t)o->mode; h.layout = (uint32_t)o->layout;
+    h.created = (int64_t)time(NULL);
+    h.src = 0; h.dst = strlen(src) + 1;
+    h.strs_size = h.dst + strlen(dst) + 1;
+    const plan_part_t *parts = m->plan->parts;
+    for (const plan_part_t *p = parts; p; p = p->next) { h.n_recs += p->n; h.strs_size += p->slen; }
+    h.recs_off = sizeof(h);
+    h.strs_off = h.recs_off + h.n_recs * sizeof(plan_rec_t);
+
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) die("Path too long: %s", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) die("Cannot write plan '%s' (%s)", tmp, strerror(errno));
+    bool ok = write_full(fd, (const char *)&h, sizeof(h));
+    uint64_t base = h.dst + strlen(dst) + 1;
+    plan_rec_t buf[256];
+    for (const plan_part_t *p = parts; p && ok; base += p->slen, p = p->next) {
+        for (size_t i = 0; i < p->n && ok; ) {
+            size_t k = 0;
+            for (; k < 256 && i < p->n; k++, i++) {
+                buf[k] = p->recs[i]; buf[k].src += base; buf[k].target += base;
             }
+            ok = write_full(fd, (const char *)buf, k * sizeof(plan_rec_t));
         }
     }
-    closedir(d);
+    ok = ok && write_full(fd, src, strlen(src) + 1) && write_full(fd, dst, strlen(dst) + 1);
+    for (const plan_part_t *p = parts; p && ok; p = p->next) ok = write_full(fd, p->strs, p->slen);
+    if (close(fd) != 0) ok = false;
+    if (!ok || rename(tmp, path) != 0) { int e = errno; unlink(tmp); die("Cannot write plan '%s' (%s)", path, strerror(e)); }
+    return (unsigned long)h.n_recs;
 }
 
-// ------------------------------ Worker ------------------------------
-static void *worker_main(void *arg) {
-    const options_t *o = (const options_t *)arg;
-    job_t j;
-    while (pop_job(&j)) {
-        const char *name = basename_const(j.rel_path);
-        char target[PATH_MAX];
-        bool skip=false, overwrite=false;
+// Empties the parts for the next run; the workers keep appending to them.
+static void plan_reset(plan_t *pl) {
+    for (plan_part_t *p = pl->parts; p; p = p->next) p->n = p->slen = 0;
+}
+
+// Once the workers are gone.
+static void plan_free(plan_t *pl) {
+    plan_part_t *p = pl->parts;
+    while (p) { plan_part_t *n = p->next; free(p->recs); free(p->strs); free(p); p = n; }
+    pl->parts = NULL;
+    if (pl->map) munmap(pl->map, pl->len);
+    pl->map = NULL;
+}
+
+static const char *plan_string(const plan_t *pl, uint64_t off, const char *path) {
+    if (off >= pl->h->strs_size) die("Corrupt plan '%s': string offset out of range", path);
+    return pl->strs + off;
+}
+
+// A planned target must stay below DEST_DIR.
+static bool plan_target_ok(const char *t) {
+    if (!*t || *t == '/') return false;
+    for (const char *c = t; c; c = strchr(c, '/')) {
+        if (*c == '/') c++;
+        if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || !c[2])) return false;
+    }
+    return true;
+}
+
+// Maps and validates a plan; fills SOURCE_DIR/DEST_DIR, mode and layout from it.
+static void plan_load(plan_t *pl, const char *path, options_t *o) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) die("Cannot open plan '%s' (%s)", path, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0) die("Cannot stat plan '%s' (%s)", path, strerror(errno));
+    if ((size_t)st.st_size < sizeof(plan_header_t)) die("Not a plan file: %s", path);
+    pl->len = (size_t)st.st_size;
+    pl->map = mmap(NULL, pl->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pl->map == MAP_FAILED) { pl->map = NULL; die("Cannot map plan '%s' (%s)", path, strerror(errno)); }
+    const plan_header_t *h = pl->h = (const plan_header_t *)pl->map;
+    if (memcmp(h->magic, PLAN_MAGIC, sizeof(PLAN_MAGIC)) != 0) die("Not a plan file: %s", path);
+    if (h->version != PLAN_VERSION || h->rec_size != sizeof(plan_rec_t))
+        die("Unsupported plan version %u in '%s'", (unsigned)h->version, path);
+    if (h->recs_off > pl->len || h->n_recs > (pl->len - h->recs_off) / sizeof(plan_rec_t) ||
+        h->strs_off > pl->len || h->strs_size > pl->len - h->strs_off || h->strs_size == 0 ||
+        ((const char *)pl->map)[h->strs_off + h->strs_size - 1] != '\0' ||
+        h->mode > MODE_DEDUP || h->layout > LAYOUT_CAS)
+        die("Corrupt plan: %s", path);
+    pl->recs = (const plan_rec_t *)((const char *)pl->map + h->recs_off);
+    pl->strs = (const char *)pl->map + h->strs_off;
+    for (uint64_t i = 0; i < h->n_recs; i++) {
+        const plan_rec_t *r = &pl->recs[i];
+        if (*plan_string(pl, r->src, path) != '/' || !plan_target_ok(plan_string(pl, r->target, path)))
+            die("Corrupt plan '%s': bad record %llu", path, (unsigned long long)i);
+    }
+    madvise(pl->map, pl->len, MADV_SEQUENTIAL);
+    o->src = (char *)plan_string(pl, h->src, path);
+    o->dst = (char *)plan_string(pl, h->dst, path);
+    o->mode = (mode_tg)h->mode;
+    o->layout = (layout_kind_t)h->layout;
+}
+
+// Queues every record (checked by plan_load); used in place of traverse_and_queue().
+static void plan_queue(mnf_t *m) {
+    const plan_t *pl = m->plan;
+    const char *path = m->opt.plan_in;
+    for (uint64_t i = 0; i < pl->h->n_recs; i++) {
+        const plan_rec_t *r = &pl->recs[i];
+        job_t j = { .src_path = (char *)plan_string(pl, r->src, path), .rel_path = (char *)plan_string(pl, r->target, path),
+                    .is_symlink = (r->flags & PLAN_F_SYMLINK) != 0, .mtime = (time_t)r->mtime,
+                    .size = (off_t)r->size, .mapped = true, .planned = true };
+        STAT_ADD(queued, 1);
+        STAT_ADD(bytes_queued, (unsigned long long)r->size);
+        push_job(m, &j);
+    }
+}
+
+// ------------------------------ Undo log ------------------------------
+// --undo-log FILE records every move before it is made: 'M' for a file to be
+// moved from src to target, 'C' for a source to be dropped as a duplicate of
+// target, and 'X' to cancel the latest such record for the same pair when the
+// step failed. 'M' and 'C' are written before the rename or unlink, so a
+// killed run leaves a log that covers every file it touched, and
+// group-committed in the background (see synclog_t). --undo-sync also waits
+// for each one's commit, so that the log survives a crash of the machine too,
+// at the cost of an fdatasync() round trip per move. A record is the type, the
+// size in decimal and both paths, each NUL-terminated, then '\n'.
+// --undo FILE replays a log backwards on the workers: targets are moved back
+// (renamed where possible) and missing source directories recreated. Dropped
+// duplicates are restored first, as copies of targets the moves take away. A
+// record whose move never happened (source still there, no target) is skipped.
+#define UNDO_HEADER "mnf-undo 2\n"
+#define UNDO_HEADER_V1 "mnf-undo 1\n" // completed moves only, no 'X'
+
+typedef struct undo {
+    synclog_t log;              // --undo-log
+    bool sync;                  // --undo-sync
+    char *map; size_t len;      // --undo
+    const char **recs; size_t n;
+} undo_t;
+#define UNDO_INIT { .log = SYNCLOG_INIT("Undo log", LOCK_UNDO) }
 
-        if (o->mode == MODE_SKIP) {
-            snprintf(target, sizeof(target), "%s/%s", DST_CANON, name);
-            if (access(target, F_OK) == 0) { skip=true; }
+static unsigned long undo_append(undo_t *u, char type, const char *src, const char *target, off_t size) {
+    char num[24]; int nl = snprintf(num, sizeof(num), "%c%lld", type, (long long)size);
+    size_t ls = strlen(src) + 1, lt = strlen(target) + 1, need = (size_t)nl + 1 + ls + lt + 1;
+    char *p = synclog_reserve(&u->log, need);
+    memcpy(p, num, (size_t)nl + 1);
+    memcpy(p + nl + 1, src, ls);
+    memcpy(p + nl + 1 + ls, target, lt);
+    p[need - 1] = '\n';
+    return synclog_publish(&u->log, need);
+}
+// Records that 'src' is about to be moved ('M') or dropped ('C') and waits
+// until the record is written, or durable with --undo-sync. No-op without
+// --undo-log.
+static void undo_intent(undo_t *u, char type, const char *src, const char *target, off_t size) {
+    if (u->log.fd < 0) return;
+    unsigned long ticket = undo_append(u, type, src, target, size);
+    if (u->sync) synclog_wait(&u->log, ticket);
+    else synclog_flush(&u->log, ticket);
+}
+// Cancels the undo_intent() for a step that did not happen; needs no wait, as a
+// stale intent is harmless (see process_undo()).
+static void undo_cancel(undo_t *u, const char *src, const char *target) {
+    int e = errno;
+    if (u->log.fd >= 0) undo_append(u, 'X', src, target, 0);
+    errno = e;
+}
+// Removes 'src' as a duplicate of 'target', logged as 'C'.
+static int drop_duplicate(undo_t *u, const char *src, const char *target, off_t size) {
+    undo_intent(u, 'C', src, target, size);
+    if (unlink_src(src) == 0) return 0;
+    undo_cancel(u, src, target);
+    return -1;
+}
+
+// Never replaces an existing log: it may be the only way back from an earlier run.
+static void undo_open(undo_t *u, const char *path, bool sync) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) die("Cannot create undo log '%s' (%s)", path, strerror(errno));
+    if (!write_full(fd, UNDO_HEADER, strlen(UNDO_HEADER)) || fdatasync(fd) != 0)
+        die("Cannot write undo log '%s' (%s)", path, strerror(errno));
+    u->sync = sync;
+    synclog_start(&u->log, fd);
+}
+// Called once the run's jobs are finished.
+static void undo_close(undo_t *u) { synclog_stop(&u->log); }
+
+static void undo_load(undo_t *u, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) die("Cannot open undo log '%s' (%s)", path, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0) die("Cannot stat undo log '%s' (%s)", path, strerror(errno));
+    size_t hl = strlen(UNDO_HEADER);
+    if ((size_t)st.st_size < hl) die("Not an undo log: %s", path);
+    u->len = (size_t)st.st_size;
+    u->map = (char *)mmap(NULL, u->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (u->map == MAP_FAILED) { u->map = NULL; die("Cannot map undo log '%s' (%s)", path, strerror(errno)); }
+    bool v1 = memcmp(u->map, UNDO_HEADER_V1, hl) == 0;
+    if (!v1 && memcmp(u->map, UNDO_HEADER, hl) != 0) die("Not an undo log: %s", path);
+    const char *p = u->map + hl, *end = u->map + u->len;
+    size_t cap = 0;
+    while (p < end) {
+        if (*p != 'M' && *p != 'C' && (*p != 'X' || v1)) break;
+        const char *a = memchr(p, '\0', (size_t)(end - p));
+        const char *b = a ? memchr(a + 1, '\0', (size_t)(end - a - 1)) : NULL;
+        const char *c = b ? memchr(b + 1, '\0', (size_t)(end - b - 1)) : NULL;
+        if (!c || c + 1 >= end || c[1] != '\n' || a[1] != '/' || b[1] != '/') break;
+        if (*p == 'X') {
+            for (size_t i = u->n; i-- > 0; ) {
+                const char *r = u->recs[i], *rs = r ? r + strlen(r) + 1 : NULL;
+                if (r && strcmp(rs, a + 1) == 0 && strcmp(rs + strlen(rs) + 1, b + 1) == 0) { u->recs[i] = NULL; break; }
+            }
+            p = c + 2;
+            continue;
         }
-        if (o->mode == MODE_OVERWRITE) {
-            snprintf(target, sizeof(target), "%s/%s", DST_CANON, name);
-            overwrite = true;
+        if (u->n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            u->recs = (const char **)realloc(u->recs, cap * sizeof(char *)); if (!u->recs) die("OOM");
         }
-        if (o->mode == MODE_RENAME) {
-            pthread_mutex_lock(&name_mx);
-            unique_path(target, sizeof(target), DST_CANON, name);
-            pthread_mutex_unlock(&name_mx);
+        u->recs[u->n++] = p;
+        p = c + 2;
+    }
+    if (p != end) logf(1, "Warning: ignoring %zu bytes of incomplete records at the end of '%s'", (size_t)(end - p), path);
+    size_t n = 0;
+    for (size_t i=0;i<u->n;i++) if (u->recs[i]) u->recs[n++] = u->recs[i];
+    u->n = n;
+}
+
+// Queues the log's copies (dropped duplicates) or its moves, newest first.
+static unsigned long undo_queue(mnf_t *m, bool copies) {
+    const undo_t *u = m->undo;
+    unsigned long n = 0;
+    for (size_t i = u->n; i-- > 0; ) {
+        const char *r = u->recs[i];
+        if ((r[0] == 'C') != copies) continue;
+        const char *src = r + strlen(r) + 1, *target = src + strlen(src) + 1;
+        off_t size = (off_t)strtoll(r + 1, NULL, 10);
+        job_t j = { .src_path = (char *)target, .rel_path = (char *)src, .size = size, .mapped = true, .keep_src = copies };
+        STAT_ADD(queued, 1);
+        STAT_ADD(bytes_queued, (unsigned long long)size);
+        push_job(m, &j);
+        n++;
+    }
+    return n;
+}
+
+static void undo_free(undo_t *u) {
+    free(u->recs);
+    if (u->map) munmap(u->map, u->len);
+    u->map = NULL; u->recs = NULL; u->n = 0;
+}
+
+// ------------------------------ Worker ------------------------------
+
+// Charges the time since *t to phase p and restarts the clock.
+static void phase_mark(phase_t p, uint64_t *t) {
+    uint64_t now = now_ns();
+    add_phase(p, now - *t);
+    *t = now;
+}
+
+static job_result_t job_failed(const options_t *o, const job_t *j, job_out_t *out) {
+    out->err = errno;
+    // Resuming a plan: a source that is gone was moved before the interruption.
+    // Watching: the file was reported twice and the first job moved it.
+    if (((j->planned && o->resume) || o->watch) && out->err == ENOENT && access(j->src_path, F_OK) != 0) {
+        logf(2, "Skip (already moved): %s", j->src_path);
+        return JOB_SKIPPED;
+    }
+    logf(1, "ERROR: cannot move '%s' (%s)", j->src_path, strerror(out->err));
+    return JOB_FAILED;
+}
+
+// What a dry run expects the move to be; a missing shard directory would be created on DEST_DIR's device.
+static move_method_t predict_method(const job_t *j, const dest_dir_t *dd) {
+    if (j->is_symlink) return METHOD_SYMLINK;
+    return j->dev == (dd->fd >= 0 ? dd->dev : dd->owner->root.dev) ? METHOD_RENAME : METHOD_COPY;
+}
+
+// --undo: each worker keeps the directory it restored into last open.
+static __thread struct { char path[PATH_MAX]; int fd; } tls_undo_dir = { "", -1 };
+
+static int undo_dir_fd(const char *dir) {
+    if (tls_undo_dir.fd >= 0 && strcmp(tls_undo_dir.path, dir) == 0) return tls_undo_dir.fd;
+    if (tls_undo_dir.fd >= 0) close(tls_undo_dir.fd);
+    tls_undo_dir.fd = -1;
+    sys_add(SC_OPEN);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        // Recreate the directories the run emptied and pruned.
+        char p[PATH_MAX]; snprintf(p, sizeof(p), "%s", dir);
+        for (char *c = p + 1;; c++) {
+            if (*c && *c != '/') continue;
+            char ch = *c; *c = '\0';
+            sys_add(SC_MKDIR);
+            if (mkdir(p, 0775) != 0 && errno != EEXIST) return -1;
+            if (!ch) break;
+            *c = ch;
         }
+        sys_add(SC_OPEN);
+        fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd < 0) return -1;
+    snprintf(tls_undo_dir.path, sizeof(tls_undo_dir.path), "%s", dir);
+    return tls_undo_dir.fd = fd;
+}
 
-        if (skip) {
-            logf(2, "Skip (exists): %s", name);
-            add_skipped();
-            free(j.src_path); free(j.rel_path);
-            continue;
+// Restores a dropped duplicate as a copy of the target it was identical to.
+static int undo_copy(const char *from, const struct stat *st, int dirfd, const char *name, bool preserve_times,
+                     move_method_t *method) {
+    if (S_ISLNK(st->st_mode)) {
+        sys_add(SC_STAT);
+        char link[PATH_MAX]; ssize_t len = readlink(from, link, sizeof(link)-1);
+        if (len < 0) return -1;
+        link[len] = '\0';
+        *method = METHOD_SYMLINK;
+        sys_add(SC_SYMLINK);
+        return symlinkat(link, dirfd, name);
+    }
+    char tmp[64]; tmp_name(tmp, sizeof(tmp));
+    int rc = copy_file_rw(from, dirfd, tmp, st->st_mode, preserve_times, NULL);
+    if (rc >= 0) { *method = rc ? METHOD_CLONE : METHOD_COPY; rc = rename_noreplace_at(dirfd, tmp, dirfd, name); }
+    if (rc < 0) { int e = errno; sys_add(SC_UNLINK); unlinkat(dirfd, tmp, 0); errno = e; return -1; }
+    return 0;
+}
+
+// --undo: moves j->src_path (a target of the logged run) back to j->rel_path.
+static job_result_t process_undo(mnf_t *m, const job_t *j, job_out_t *out) {
+    const options_t *o = &m->opt;
+    const char *to = j->rel_path, *name = basename_const(to);
+    snprintf(out->target, sizeof(out->target), "%s", to);
+    if (o->dry_run) {
+        logf(1, "WOULD RESTORE%s: '%s' -> '%s'", j->keep_src ? " (copy)" : "", j->src_path, to);
+        return JOB_WOULD_MOVE;
+    }
+    uint64_t t = now_ns();
+    tls_phase = PHASE_PLACE;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", name - to > 1 ? (int)(name - to - 1) : 1, to);
+    int dfd = undo_dir_fd(dir);
+    phase_mark(PHASE_PLACE, &t);
+    if (dfd < 0) return job_failed(o, j, out);
+
+    tls_phase = PHASE_TRANSFER;
+    struct stat st;
+    sys_add(SC_STAT);
+    int rc = lstat(j->src_path, &st);
+    struct stat orig;
+    sys_add(SC_STAT);
+    if (fstatat(dfd, name, &orig, AT_SYMLINK_NOFOLLOW) == 0) {
+        // The logged run stopped between recording this step and taking it, or
+        // (cross-device) between landing the copy and removing the source.
+        if (j->keep_src || (rc != 0 && errno == ENOENT)) { logf(2, "Skip (not moved): %s", to); return JOB_SKIPPED; }
+        if (rc == 0 && !j->keep_src && same_content(j->src_path, to)) {
+            if (unlink_src(j->src_path) != 0) return job_failed(o, j, out);
+            logf(2, "Restored: '%s' -> '%s'", j->src_path, to);
+            return JOB_MOVED;
         }
-        if (o->dry_run) {
-            logf(1, "WOULD MOVE: '%s' -> '%s'", j.src_path, target);
-            add_skipped();
-            free(j.src_path); free(j.rel_path);
-            continue;
+    }
+    if (rc == 0 && j->keep_src) rc = undo_copy(j->src_path, &st, dfd, name, o->preserve_times, &out->method);
+    else if (rc == 0) {
+        undo_intent(m->undo, 'M', j->src_path, to, j->size);
+        if (S_ISLNK(st.st_mode)) { out->method = METHOD_SYMLINK; rc = move_symlink(j->src_path, dfd, name, false); }
+        else rc = move_file_with_modes(m->jr, j->src_path, dfd, name, to, false, o->preserve_times, &out->method);
+        if (rc != 0) undo_cancel(m->undo, j->src_path, to);
+    }
+    phase_mark(PHASE_TRANSFER, &t);
+    if (rc != 0) return job_failed(o, j, out);
+    logf(2, "Restored: '%s' -> '%s'", j->src_path, to);
+    return JOB_MOVED;
+}
+
+static job_result_t process_cas(mnf_t *m, const job_t *j, job_out_t *out) {
+    const options_t *o = &m->opt;
+    const char *target = out->target;
+    uint64_t t = now_ns();
+    tls_phase = PHASE_TRANSFER;
+    cas_result_t cr = cas_move(m, j->src_path, j->is_symlink, out->target, sizeof(out->target), &out->method);
+    phase_mark(PHASE_TRANSFER, &t);
+    if (cr == CAS_FAILED) return job_failed(o, j, out);
+    if (o->dry_run) {
+        out->method = predict_method(j, &m->dests.root);
+        logf(1, "%s: '%s' -> '%s'", cr == CAS_DUP ? "WOULD DROP (duplicate)" : "WOULD MOVE", j->src_path, target);
+        return cr == CAS_DUP ? JOB_WOULD_DROP : JOB_WOULD_MOVE;
+    }
+    if (cr == CAS_DUP) { logf(2, "Duplicate: '%s' == '%s'", j->src_path, target); return JOB_DEDUPED; }
+    logf(2, "Moved: '%s' -> '%s'", j->src_path, target);
+    return JOB_MOVED;
+}
+
+// Places and moves one file; the final target is left in 'target' for reporting.
+static job_result_t process_job(mnf_t *m, const job_t *j, job_out_t *out) {
+    const options_t *o = &m->opt;
+    if (o->undo) return process_undo(m, j, out);
+    if (o->layout == LAYOUT_CAS) return process_cas(m, j, out);
+
+    char *target = out->target; size_t targetsz = sizeof(out->target);
+    uint64_t t = now_ns();
+    tls_phase = PHASE_PLACE;
+
+    const char *name = basename_const(j->rel_path);
+    char shard[PATH_MAX], tname[PATH_MAX];
+    if (j->planned) snprintf(shard, sizeof(shard), "%.*s", (int)(name > j->rel_path ? name - j->rel_path - 1 : 0), j->rel_path);
+    else shard_rel(o->shard, o->shard_buckets, o->shard_datefmt, name, j->mtime, shard, sizeof(shard));
+    dest_dir_t *dd = dest_dir_get(&m->dests, shard, !o->dry_run);
+    if (dd->fd < 0 && !o->dry_run) {
+        logf(1, "ERROR: cannot create '%s/%s' (%s)", m->dests.canon, dd->rel, strerror(dd->err));
+        out->err = dd->err;
+        return JOB_FAILED;
+    }
+
+    dedup_src_t src = { .path = j->src_path, .fd = -1 };
+    bool dedup = o->mode == MODE_DEDUP && !j->is_symlink;
+    if (dedup) {
+        uint64_t tl = op_begin();
+        sys_add(SC_STAT);
+        if (lstat(j->src_path, &src.st) != 0) return job_failed(o, j, out);
+        op_end(OP_LSTAT, tl);
+    }
+
+    // A name chosen here can be taken by another worker (or process) before the
+    // move lands; moves never replace in rename/skip/dedup mode, so EEXIST re-places.
+    int rc = 0, err = 0; bool skip = false, dup = false; // err: no name could be placed
+    for (;;) {
+        bool overwrite = false;
+        uint64_t tp = op_begin();
+        tls_phase = PHASE_PLACE;
+        if (dedup) {
+            dedup_result_t dr = dedup_place(dd, name, &src, tname, sizeof(tname));
+            if (dr == DEDUP_FAILED) { err = errno; break; }
+            dup = dr == DEDUP_DUP;
+        } else if (o->mode == MODE_RENAME || o->mode == MODE_DEDUP) {
+            mx_lock(&dd->mx, LOCK_DEST_DIR);
+            bool named = unique_name(tname, sizeof(tname), dd, name);
+            if (named && o->dry_run) dest_claim(dd, tname, j->src_path);
+            pthread_mutex_unlock(&dd->mx);
+            if (!named) { err = errno; break; }
+        } else if (o->dry_run) {
+            snprintf(tname, sizeof(tname), "%s", name);
+            mx_lock(&dd->mx, LOCK_DEST_DIR);
+            skip = !dest_claim(dd, tname, j->src_path) && o->mode == MODE_SKIP;
+            pthread_mutex_unlock(&dd->mx);
+        } else {
+            snprintf(tname, sizeof(tname), "%s", name);
+            if (o->mode == MODE_SKIP) skip = dest_exists(dd, tname);
+            else overwrite = true;
+        }
+        if (!dest_path(target, targetsz, dd, tname)) { err = errno; break; }
+        op_end(OP_PLACE, tp);
+        phase_mark(PHASE_PLACE, &t);
+        tls_phase = PHASE_TRANSFER;
+        if (skip || dup || o->dry_run) break;
+
+        undo_intent(m->undo, 'M', j->src_path, target, j->size);
+        if (j->is_symlink) { out->method = METHOD_SYMLINK; rc = move_symlink(j->src_path, dd->fd, tname, overwrite); }
+        else rc = move_file_with_modes(m->jr, j->src_path, dd->fd, tname, target, overwrite, o->preserve_times, &out->method);
+        if (rc != 0) undo_cancel(m->undo, j->src_path, target);
+        phase_mark(PHASE_TRANSFER, &t);
+        if (rc == 0 || errno != EEXIST || overwrite) break;
+        if (o->mode == MODE_SKIP) { skip = true; break; }
+    }
+    if (src.fd >= 0) close(src.fd);
+    if (err) { errno = err; return job_failed(o, j, out); }
+    if (o->dry_run) out->method = predict_method(j, dd);
+
+    if (dup) {
+        if (o->dry_run) { logf(1, "WOULD DROP (duplicate): '%s' == '%s'", j->src_path, target); return JOB_WOULD_DROP; }
+        if (drop_duplicate(m->undo, j->src_path, target, j->size) != 0) {
+            out->err = errno;
+            logf(1, "ERROR: cannot remove duplicate '%s' (%s)", j->src_path, strerror(out->err));
+            return JOB_FAILED;
         }
+        logf(2, "Duplicate: '%s' == '%s'", j->src_path, target);
+        return JOB_DEDUPED;
+    }
+    if (skip) { logf(2, "Skip (exists): %s", target); return JOB_SKIPPED; }
+    if (o->dry_run) { logf(1, "WOULD MOVE: '%s' -> '%s'", j->src_path, target); return JOB_WOULD_MOVE; }
+    if (rc != 0) return job_failed(o, j, out);
+
+    if (dedup) dedup_remember(dd, tname, &src);
+    out->renamed = strcmp(tname, name) != 0;
+    logf(2, "Moved: '%s' -> '%s'", j->src_path, target);
+    return JOB_MOVED;
+}
 
-        int rc = 0;
-        if (j.is_symlink) rc = move_symlink(j.src_path, target, overwrite);
-        else rc = move_file_with_modes(j.src_path, target, overwrite, o->preserve_times, o->progress);
+// Keeps the SLOW_TOP slowest jobs of the calling thread.
+static void slow_note(const char *path, off_t size, uint64_t ns) {
+    struct slow_file *v = stats_slot()->slowest, *min = &v[0];
+    for (int i=1;i<SLOW_TOP;i++) if (v[i].ns < min->ns) min = &v[i];
+    if (ns <= min->ns) return;
+    free(min->path);
+    min->ns = ns; min->size = size; min->path = xstrdup(path);
+}
 
-        if (rc == 0) { logf(2, "Moved: '%s' -> '%s'", j.src_path, target); add_moved(); }
-        else { logf(1, "ERROR: cannot move '%s' (%s)", j.src_path, strerror(errno)); add_failed(); }
+#ifndef MNF_LIBRARY
+static int slow_cmp(const void *a, const void *b) {
+    uint64_t x = ((const struct slow_file *)a)->ns, y = ((const struct slow_file *)b)->ns;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+// Prints the SLOW_TOP slowest jobs over all threads; call after the workers are joined.
+static void print_slowest(void) {
+    size_t n = 0, cap = 0; struct slow_file *all = NULL;
+    for (stats_slot_t *s = stats_slots; s; s = s->next) {
+        for (int i=0;i<SLOW_TOP;i++) {
+            if (!s->slowest[i].path) continue;
+            if (n == cap) { cap = cap ? cap * 2 : 64; all = (struct slow_file *)realloc(all, cap * sizeof(*all)); if (!all) die("OOM"); }
+            all[n++] = s->slowest[i];
+        }
+    }
+    if (!n) return;
+    qsort(all, n, sizeof(*all), slow_cmp);
+    logf(1, "Slowest files:");
+    for (size_t i=0;i<n && i<SLOW_TOP;i++) {
+        char sz[32]; format_bytes(sz, sizeof(sz), (double)all[i].size);
+        logf(1, "%10.1f ms %10s  %s", all[i].ns / 1e6, sz, all[i].path);
+    }
+    free(all);
+}
+#endif
 
-        free(j.src_path); free(j.rel_path);
+static void *worker_main(void *arg) {
+    mnf_t *m = (mnf_t *)arg;
+    const options_t *o = &m->opt; // changes only while the workers are idle
+    job_t j;
+    tls_verbose = o->verbose;
+    tls_stats = m->slots[__atomic_fetch_add(&m->started, 1, __ATOMIC_RELAXED)];
+    trace_thread("worker");
+    while (pop_job(m, &j)) {
+        job_out_t out; out.target[0] = '\0'; out.method = METHOD_NONE; out.renamed = false; out.err = 0;
+        uint64_t t0 = (events_sink.active || trace_sink.active || g_slow_ns) ? now_ns() : 0;
+        tls_op_path = j.src_path; tls_op_bytes = j.size;
+        STAT_SET(busy, 1);
+        job_result_t r = __atomic_load_n(&m->cancel, __ATOMIC_RELAXED) ? JOB_SKIPPED : process_job(m, &j, &out);
+        STAT_SET(busy, 0);
+        job_release_io(m, &j);
+        if (r != JOB_MOVED && r != JOB_DEDUPED) state_dirty(j.sd);
+        state_dir_release(j.sd, r == JOB_MOVED || r == JOB_DEDUPED);
+        if (o->plan_out) plan_note(m, &j, r, &out);
+        if (m->cb) event_callback(m, &j, r, &out);
+        if (t0) {
+            uint64_t t1 = now_ns();
+            if (events_sink.active) event_job(&j, r, &out, t1 - t0);
+            trace_span("job", t0, t1, j.src_path);
+            if (g_slow_ns) slow_note(j.src_path, j.size, t1 - t0);
+        }
+        tls_op_path = NULL; tls_op_bytes = -1;
+        switch (r) {
+            case JOB_MOVED: add_moved(); add_method(out.method, j.size); break;
+            case JOB_DEDUPED: add_deduped(); break;
+            case JOB_FAILED: add_failed(); break;
+            default: add_skipped(); break;
+        }
+        STAT_ADD(bytes_done, (unsigned long long)j.size);
+        job_finish(&j, r == JOB_MOVED || r == JOB_DEDUPED);
+        __atomic_sub_fetch(&m->q.pending, 1, __ATOMIC_ACQ_REL); // run_wait() is woken by the last to sleep
+        sink_flush_thread(true);
     }
+    sink_flush_thread(false);
+    if (tls_undo_dir.fd >= 0) close(tls_undo_dir.fd);
+    stats_slot_retire();
     return NULL;
 }
 
-// ------------------------------ main ------------------------------
-int main(int argc, char **argv) {
-    options_t opt; parse_options(argc, argv, &opt);
+// Starts the handle's pool; each worker counts into the slot picked for it
+// here, so that a run's counts can be read off m->slots.
+static void start_workers(mnf_t *m) {
+    m->ths = (pthread_t *)calloc((size_t)m->nth, sizeof(pthread_t));
+    m->slots = (stats_slot_t **)calloc((size_t)m->nth, sizeof(stats_slot_t *));
+    if (!m->ths || !m->slots) die("OOM");
+    for (int i=0;i<m->nth;i++) m->slots[i] = stats_slot_new();
+    for (int i=0;i<m->nth;i++) {
+        if (pthread_create(&m->ths[i], NULL, worker_main, m) != 0) die("pthread_create failed");
+    }
+}
+static void join_workers(mnf_t *m) {
+    for (int i=0;i<m->nth;i++) pthread_join(m->ths[i], NULL);
+}
+
+// ------------------------------ Handles ------------------------------
+// A handle (mnf_t) is one engine: its options, worker pool, job queue, device
+// limits, destination tables and run files (--journal, --undo*, --state,
+// --plan-*). Handles share nothing but the log sinks and the stats slots, so
+// the runs of different handles go on at the same time; main() runs on a
+// handle as well. --watch and --serve keep process-wide state, which is why
+// the library leaves them to the command line.
+static mnf_t *handle_new(void) {
+    mnf_t *m = (mnf_t *)calloc(1, sizeof(*m));
+    if (!m) return NULL;
+    m->jr = (journal_t *)malloc(sizeof(journal_t));
+    m->undo = (undo_t *)malloc(sizeof(undo_t));
+    m->state = (state_t *)calloc(1, sizeof(state_t));
+    m->plan = (plan_t *)calloc(1, sizeof(plan_t));
+    if (!m->jr || !m->undo || !m->state || !m->plan) {
+        free(m->jr); free(m->undo); free(m->state); free(m->plan); free(m);
+        return NULL;
+    }
+    *m->jr = (journal_t)JOURNAL_INIT;
+    *m->undo = (undo_t)UNDO_INIT;
+    pthread_mutex_init(&m->q.mx, NULL);
+    pthread_cond_init(&m->q.cv, NULL);
+    pthread_cond_init(&m->q.idle, NULL);
+    pthread_mutex_init(&m->run_mx, NULL);
+    m->limits = (io_limits_t)IO_LIMITS_DEFAULT;
+    return m;
+}
+
+// Loads what the parsed options refer to; may die().
+static void handle_open(mnf_t *m) {
+    options_t *o = &m->opt;
+    io_limits_parse(o, &m->limits);
+    if (o->plan_in) plan_load(m->plan, o->plan_in, o);
+    if (o->undo) undo_load(m->undo, o->undo);
+    if (o->watch) watch_open();
+    else if (o->serve) srv.sig = stop_signals();
+    m->nth = o->threads > 0 ? o->threads : 1;
+}
+
+static void handle_free(mnf_t *m) {
+    const options_t *o = &m->opt;
+    if (m->ths) { finish_jobs(m); join_workers(m); }
+    if (m->dest_ready) dest_free(&m->dests);
+    queue_free(m);
+    roots_free(m);
+    plan_free(m->plan);
+    if (m->undo) undo_free(m->undo); // NULL for a --serve request's handle
+    state_free(m->state);
+    if (o->watch) watch_close();
+    free(m->jr); free(m->undo); free(m->state); free(m->plan);
+    free(m->ths); free(m->slots);
+    options_free(&m->opt);
+    pthread_mutex_destroy(&m->q.mx);
+    pthread_cond_destroy(&m->q.cv);
+    pthread_cond_destroy(&m->q.idle);
+    pthread_mutex_destroy(&m->run_mx);
+    free(m);
+}
+
+// Opens the run's --journal and --undo-log, and drops what the last run
+// gathered for --state and --plan-out.
+static void run_files_open(mnf_t *m) {
+    const options_t *o = &m->opt;
+    state_free(m->state);
+    plan_reset(m->plan);
+    if (o->journal) journal_open(m->jr, o->journal, o->resume);
+    if (o->undo_log) undo_open(m->undo, o->undo_log, o->undo_sync);
+}
+// Commits the logs and writes --plan-out and --state; once the run's jobs are finished.
+static void run_files_close(mnf_t *m) {
+    const options_t *o = &m->opt;
+    journal_close(m->jr);
+    undo_close(m->undo);
+    if (o->plan_out && !__atomic_load_n(&m->cancel, __ATOMIC_RELAXED)) m->planned = plan_write(o->plan_out, m);
+    if (o->state && !o->dry_run) m->recorded = state_write(m->state, o->state);
+}
+
+// Calls f(m); in libmnf a die() in it fails the run with its message in 'err'
+// instead of ending the process.
+static bool run_guarded(mnf_t *m, void (*f)(mnf_t *), char *err, size_t errlen) {
+#ifdef MNF_LIBRARY
+    jmp_buf jb;
+    if (setjmp(jb)) {
+        tls_die_jmp = NULL;
+        snprintf(err, errlen, "%s", tls_die_msg);
+        return false;
+    }
+    tls_die_jmp = &jb;
+#else
+    (void)err; (void)errlen;
+#endif
+    f(m);
+    tls_die_jmp = NULL;
+    return true;
+}
+
+int mnf_run(mnf_t *m, const mnf_run_t *run, mnf_stats_t *stats, char *err, size_t errlen) {
+    const options_t *o = &m->opt;
+    bool ok = true;
+    mnf_run_t planned;
+    if (o->plan_in) { // the plan names SOURCE_DIR and DEST_DIR
+        planned = (mnf_run_t){ o->src, o->dst, run->dry_run, NULL, 0 };
+        run = &planned;
+    }
+    pthread_mutex_lock(&m->run_mx);
+    int verbose = tls_verbose;
+    tls_verbose = o->verbose;
+    __atomic_store_n(&m->traversed, false, __ATOMIC_RELAXED);
+    if (!m->ths && !o->serve) start_workers(m); // --serve runs its requests on handles of their own
+    run_counts_t before, c;
+    run_counts(m, &before);
+
+    if (o->undo) logf(1, "Undo  : %s (%zu files)", o->undo, m->undo->n);
+    else if (!o->serve) {
+        const char *const *srcs = run->n_sources ? run->sources : &run->src;
+        size_t n = run->n_sources ? run->n_sources : 1;
+        if (!srcs[0] || !run->dst) { snprintf(err, errlen, "no source or destination given"); ok = false; }
+        else ok = run_prepare(m, srcs, n, run->dst, run->dry_run || o->dry_run, err, errlen);
+        if (ok) {
+            for (size_t i=0;i<m->roots.n;i++) logf(1, "Source: %s", m->roots.canon[i]);
+            logf(1, "Dest  : %s", m->dests.canon);
+            if (o->plan_in) logf(1, "Plan  : %s (%llu files)", o->plan_in, (unsigned long long)m->plan->h->n_recs);
+            for (size_t i=0;i<m->roots.n;i++) {
+                if (is_under(m->dests.canon, m->roots.canon[i])) {
+                    logf(1, "Note: destination lies within source; that subtree will be excluded.");
+                    break;
+                }
+            }
+        }
+    }
+    if (ok && !run_guarded(m, run_files_open, err, errlen)) {
+        journal_close(m->jr);
+        ok = false;
+    }
+    if (ok) {
+        if (o->serve) {
+            serve_start(o->serve, m);
+            __atomic_store_n(&m->traversed, true, __ATOMIC_RELEASE);
+            serve_loop(m);
+        } else if (o->undo) {
+            // Copies of dropped duplicates read targets that the moves take away.
+            if (undo_queue(m, true)) run_wait(m, &before, NULL, NULL);
+            undo_queue(m, false);
+            __atomic_store_n(&m->traversed, true, __ATOMIC_RELEASE);
+            run_wait(m, &before, NULL, NULL);
+        } else {
+            if (o->state) state_load(m->state, o->state, m);
+            run_tree(m, &before, NULL, NULL);
+        }
+        ok = run_guarded(m, run_files_close, err, errlen);
+    }
+    sink_flush_thread(false);
+    tls_verbose = verbose;
+    run_counts_since(m, &before, &c);
+    __atomic_store_n(&m->cancel, false, __ATOMIC_RELAXED); // kept until here, so an early one stops this run
+    pthread_mutex_unlock(&m->run_mx);
+    if (stats) {
+        stats->moved = c.moved; stats->skipped = c.skipped; stats->failed = c.failed;
+        stats->deduped = c.deduped; stats->queued = c.queued; stats->bytes = c.bytes;
+    }
+    return ok ? 0 : -1;
+}
+
+// Asks the handle's current or next run to stop; a plain store, so a signal handler may call it.
+void mnf_cancel(mnf_t *m) {
+    if (m) __atomic_store_n(&m->cancel, true, __ATOMIC_RELAXED);
+}
+
+void mnf_close(mnf_t *m) {
+    if (m) handle_free(m);
+}
 
-    if (!realpath(opt.src, SRC_CANON)) die("Source not found: %s", opt.src);
-    if (access(opt.dst, F_OK) != 0) { if (mkdir(opt.dst, 0775) != 0) die("Cannot create destination: %s", opt.dst); }
-    if (!realpath(opt.dst, DST_CANON)) die("Cannot resolve destination path: %s", opt.dst);
-    if (access(DST_CANON, W_OK) != 0 && !opt.dry_run) die("No write permission in destination: %s", DST_CANON);
+#ifdef MNF_LIBRARY
+// ------------------------------ Library ------------------------------
+// libmnf (include/mnf.h): the engine without main(). Each mnf_open() makes a
+// handle, with options parsed from argv or taken from an mnf_options_t; its
+// pool starts with its first run.
 
-    logf(1, "Source: %s", SRC_CANON);
-    logf(1, "Dest  : %s", DST_CANON);
-    if (is_under(DST_CANON, SRC_CANON)) {
-        logf(1, "Note: destination lies within source; that subtree will be excluded.");
+// Sets up a new handle from 'argv' (program name first) or, if that is NULL,
+// from 'p'; die() turns into a false return with its message in tls_die_msg.
+static bool lib_setup(mnf_t *m, int argc, char **argv, const mnf_options_t *p) {
+    static pthread_mutex_t parse_mx = PTHREAD_MUTEX_INITIALIZER; // getopt keeps its state in globals
+    pthread_mutex_lock(&parse_mx);
+    jmp_buf jb;
+    if (setjmp(jb)) {
+        tls_die_jmp = NULL;
+        pthread_mutex_unlock(&parse_mx);
+        return false;
     }
+    tls_die_jmp = &jb;
+    if (argv) {
+        optind = 0; opterr = 0;
+        parse_options(argc, argv, &m->opt, true);
+    } else options_from(p, &m->opt);
+    const options_t *o = &m->opt;
+    if (o->watch || o->serve || o->events || o->trace || o->metrics_file || o->metrics_socket || o->progress)
+        die("option not available in libmnf (watch, serve, events, trace, metrics, progress)");
+    handle_open(m);
+    tls_die_jmp = NULL;
+    pthread_mutex_unlock(&parse_mx);
+    return true;
+}
 
-    int nth = opt.threads > 0 ? opt.threads : 1;
-    pthread_t *ths = (pthread_t *)calloc((size_t)nth, sizeof(pthread_t)); if (!ths) die("OOM");
-    for (int i=0;i<nth;i++) {
-        if (pthread_create(&ths[i], NULL, worker_main, &opt) != 0) die("pthread_create failed");
+static mnf_t *lib_open(int argc, char **argv, const mnf_options_t *p, char *err, size_t errlen) {
+    mnf_t *m = handle_new();
+    if (!m) { snprintf(err, errlen, "out of memory"); return NULL; }
+    if (!lib_setup(m, argc, argv, p)) {
+        snprintf(err, errlen, "%s", tls_die_msg);
+        handle_free(m);
+        return NULL;
     }
+    return m;
+}
 
-    traverse_and_queue(&opt, SRC_CANON, 0, "");
+mnf_t *mnf_open(int argc, const char *const argv[], char *err, size_t errlen) {
+    char **args = (char **)calloc((size_t)argc + 2, sizeof(char *));
+    if (!args) { snprintf(err, errlen, "out of memory"); return NULL; }
+    args[0] = (char *)"libmnf";
+    for (int i = 0; i < argc; i++) args[i + 1] = (char *)argv[i]; // getopt only permutes the array
+    mnf_t *m = lib_open(argc + 1, args, NULL, err, errlen);
+    free(args);
+    return m;
+}
 
-    finish_jobs();
-    for (int i=0;i<nth;i++) pthread_join(ths[i], NULL);
-    free(ths);
+void mnf_options_init(mnf_options_t *p) {
+    memset(p, 0, sizeof(*p));
+    p->threads = 1;
+    p->min_depth = 1; p->max_depth = -1;
+    p->min_size = p->max_size = p->newer_than = p->older_than = -1;
+    p->preserve_times = 1;
+    p->ignore_files = 1;
+}
+
+mnf_t *mnf_open_options(const mnf_options_t *p, char *err, size_t errlen) {
+    return lib_open(0, NULL, p, err, errlen);
+}
+
+void mnf_set_callback(mnf_t *m, mnf_event_cb cb, void *user) {
+    pthread_mutex_lock(&m->run_mx);
+    m->cb = cb; m->user = user;
+    pthread_mutex_unlock(&m->run_mx);
+}
+#else
+// ------------------------------ main ------------------------------
+// A plain run stops on SIGINT/SIGTERM the way mnf_cancel() stops a library run:
+// nothing more is queued, queued files are skipped, and the logs are committed
+// before exiting with 128 + the signal number. A second signal kills at once.
+// --watch and --serve read these signals from a signalfd instead.
+static volatile sig_atomic_t g_stop_signal;
+static mnf_t *g_cli;
+
+static void on_stop_signal(int sig) {
+    g_stop_signal = sig;
+    mnf_cancel(g_cli);
+}
+static void catch_stop_signals(void) {
+    struct sigaction sa; memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sa.sa_flags = SA_RESTART | SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+int main(int argc, char **argv) {
+    mnf_t *m = g_cli = handle_new(); if (!m) die("OOM");
+    options_t *o = &m->opt;
+    parse_options(argc, argv, o, false);
+    bool metrics_on = o->metrics_file || o->metrics_socket;
+    g_op_hist = o->stats_detailed || metrics_on;
+    g_slow_ns = o->slow_ns;
+    g_op_timing = g_op_hist || o->trace || o->slow_ns;
+    tls_verbose = o->verbose;
+    uint64_t t_start = now_ns();
+    handle_open(m);
+    if (!o->watch && !o->serve) catch_stop_signals();
+
+    sink_register(&log_sink, STDOUT_FILENO, o->log_policy);
+    if (o->events) sink_register(&events_sink, events_open(o->events), o->log_policy);
+    if (o->trace) sink_register(&trace_sink, trace_open(o->trace), SINK_BLOCK);
+    sinks_start();
+    trace_thread("traversal");
+    if (o->progress) progress_start(m);
+    if (metrics_on) metrics_start(m);
 
-    if (opt.prune_empty_dirs && !opt.dry_run) prune_empty(SRC_CANON);
+    char err[PATH_MAX + 64];
+    mnf_run_t run = { o->src, o->dst, o->dry_run, (const char *const *)o->sources, o->n_sources };
+    if (mnf_run(m, &run, NULL, err, sizeof(err)) != 0) die("Cannot run: %s", err);
 
-    pthread_mutex_lock(&stats.mx);
-    unsigned long moved = stats.moved, skipped = stats.skipped, failed = stats.failed;
-    unsigned long long bytes = stats.bytes_copied;
-    pthread_mutex_unlock(&stats.mx);
+    if (o->progress) progress_stop();
+    if (metrics_on) metrics_stop();
+    sinks_stop();
+    trace_close();
+    if (log_sink.dropped) fprintf(stderr, "Warning: %lu log records dropped\n", log_sink.dropped);
+    if (events_sink.dropped) fprintf(stderr, "Warning: %lu event records dropped\n", events_sink.dropped);
 
-    logf(1, "\nDone. Moved: %lu, Skipped: %lu, Failed: %lu, Bytes copied: %llu", moved, skipped, failed, bytes);
+    stats_slot_t st; stats_snapshot(&st);
+    if (o->events) {
+        event_summary(&st, now_ns() - t_start);
+        if (events_sink.fd > STDERR_FILENO && strncmp(o->events, "fd:", 3) != 0) close(events_sink.fd);
+    }
+    unsigned long moved = st.moved, skipped = st.skipped, failed = st.failed, deduped = st.deduped;
+    unsigned long long bytes = st.bytes_copied;
+
+    if (o->mode == MODE_DEDUP || o->layout == LAYOUT_CAS)
+        logf(1, "\nDone. Moved: %lu, Skipped: %lu, Failed: %lu, Bytes copied: %llu, Duplicates dropped: %lu", moved, skipped, failed, bytes, deduped);
+    else
+        logf(1, "\nDone. Moved: %lu, Skipped: %lu, Failed: %lu, Bytes copied: %llu", moved, skipped, failed, bytes);
+    logf(2, "Renamed: %lu (%llu bytes), Copied: %lu (%llu bytes), Cloned: %lu, Symlinks: %lu",
+         st.renames, st.bytes_renamed, st.copies, st.bytes_copied, st.clones, st.symlinks);
+    logf(2, "Thread time: %s %.3fs, %s %.3fs, %s %.3fs, %s %.3fs",
+         phase_names[PHASE_TRAVERSE], st.phase_ns[PHASE_TRAVERSE] / 1e9,
+         phase_names[PHASE_PLACE], st.phase_ns[PHASE_PLACE] / 1e9,
+         phase_names[PHASE_TRANSFER], st.phase_ns[PHASE_TRANSFER] / 1e9,
+         phase_names[PHASE_PRUNE], st.phase_ns[PHASE_PRUNE] / 1e9);
+    print_sys_stats(&st, o->stats_detailed);
+    print_device_stats(m);
+    if (o->stats_detailed) { print_op_latency(); print_lock_stats(&st); }
+    if (o->slow_ns) print_slowest();
+    if (o->plan_out && !g_stop_signal) logf(1, "Plan: %lu files written to %s", m->planned, o->plan_out);
+    if (o->state) logf(2, "State: %lu directories unchanged and not read, %lu recorded", m->state->unchanged, m->recorded);
+    if (o->watch) logf(2, "Watch: %lu events, %lu rescans after overflow", watch.events, watch.rescans);
+    if (o->serve) logf(1, "Served: %lu requests", srv.served);
 
-    free_strv(opt.includes, opt.n_includes);
-    free_strv(opt.excludes, opt.n_excludes);
-    free_strv(opt.allow_ext, opt.n_allow_ext);
-    free_strv(opt.deny_ext, opt.n_deny_ext);
+    int sig = g_stop_signal;
+    g_cli = NULL;
+    mnf_close(m);
+    stats_free();
 
+    if (sig) {
+        fprintf(stderr, "Interrupted (%s)\n", strsignal(sig));
+        return 128 + sig;
+    }
     return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
+#endif